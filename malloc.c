@@ -117,6 +117,8 @@
        USE_SPIN_LOCKS=0.  However, if USE_RECURSIVE_LOCKS is defined,
        recursive versions are used instead (which are not required for
        base functionality but may be needed in layered extensions).
+       On Linux, USE_FUTEX_LOCKS selects locks that spin briefly and
+       then sleep, which behave better when threads outnumber cores.
        Using a global lock is not especially fast, and can be a major
        bottleneck.  It is designed only to provide minimal protection
        in concurrent environments, and to provide a basis for
@@ -207,6 +209,9 @@
       return mspace_malloc(tlms, bytes);
     }
     void  tlfree(void* mem) { mspace_free(tlms, mem); }
+  If compiled with USE_THREAD_MSPACES, thread_mspace() does this for
+  you, and also keeps the space alive after its thread exits for as
+  long as chunks allocated from it remain in use.
 
   Unless FOOTERS is defined, each mspace is completely independent.
   You cannot allocate from one and free to another (although
@@ -278,12 +283,276 @@ USE_RECURSIVE_LOCKS      default: not defined
   uses plain mutexes. This is not required for malloc proper, but may
   be needed for layered allocators such as nedmalloc.
 
+USE_FUTEX_LOCKS          default: 0 (false)
+  If true (on Linux with gcc >= 4.1 only), uses adaptive locks that
+  spin up to FUTEX_LOCK_SPINS times and then sleep on a futex until
+  woken by the lock holder, instead of spin locks that repeatedly call
+  sched_yield. This avoids burning CPU and long delays when there are
+  more runnable threads than processors. Setting this implies
+  USE_LOCKS, and it may not be combined with USE_RECURSIVE_LOCKS.
+
+FUTEX_LOCK_SPINS         default: 100
+  The number of times a futex lock is polled before the acquiring
+  thread goes to sleep.
+
+FUTEX_LOCK_FAIR          default: 0 (never)
+  If nonzero, a thread that has been woken this many times while
+  waiting for a futex lock, only to find it taken again by another
+  thread, has the lock handed to it (or another thread that has slept)
+  on its next release, rather than freed for any thread to grab. This
+  bounds waiting times under heavy contention, at some cost in
+  throughput when it happens.
+
 LOCK_AT_FORK            default: not defined
   If defined nonzero, performs pthread_atfork upon initialization
   to initialize child lock while holding parent lock. The implementation
   assumes that pthread locks (not custom locks) are being used. In other
   cases, you may need to customize the implementation.
 
+USE_FASTBINS             default: 0 (false)
+  If true, freed chunks of at most MAX_FAST_SIZE usable bytes are not
+  coalesced right away, but are kept (still marked as in use) on a
+  singly linked list per size, from which requests of the same size
+  are then served first. This makes alternating malloc and free of
+  tiny chunks much cheaper, as with the "fastbins" of malloc 2.7. The
+  chunks are consolidated and binned normally when a large request
+  arrives, before obtaining more memory from the system, and on
+  malloc_trim, mallinfo and malloc_stats.
+
+MAX_FAST_SIZE            default: 64 * sizeof(size_t) / 4
+  The largest request size, in bytes, whose chunks are kept in
+  fastbins when USE_FASTBINS is set (64 bytes on 32-bit systems and
+  128 on 64-bit ones). Must be less than MAX_SMALL_REQUEST.
+
+USE_SLABS                default: 0 (false)
+  If true, requests of at most SLAB_MAX_SIZE bytes are served from
+  SLAB_SIZE-byte slabs, each holding equal-size objects spaced in
+  multiples of 8 bytes, with free objects tracked in a bitmap in the
+  slab's header. Such objects have no chunk header or minimum chunk
+  size, which roughly halves the space used by the smallest requests,
+  and objects of the same size are kept together. All slabs come from
+  a single region of SLAB_REGION_SIZE bytes, reserved with mmap on
+  first use (inaccessible and uncommitted, where MAP_ANONYMOUS is
+  available) and committed a few slabs at a time as slabs are handed
+  out, so the slab holding an object is found by masking its
+  address. Each malloc_state keeps its own slabs, and completely free
+  ones (other than the last of each size) go back to a common pool,
+  but are not returned to the system. Slab objects are aligned only to
+  the largest power of two dividing their size (at least 8), which
+  suffices for any object of the size requested; memalign rounds up
+  small requests as needed. Slabs are counted in malloc_footprint,
+  and as in use by mallinfo and malloc_stats, but are not reported by
+  malloc_inspect_all. If the region is exhausted or cannot be mapped,
+  small requests are served normally. Requires HAVE_MMAP.
+
+SLAB_MAX_SIZE            default: 32
+  The largest request, in bytes, served from slabs if USE_SLABS is
+  set. Must be a multiple of 8, and at most 64.
+
+SLAB_SIZE                default: 4096
+  The size of each slab if USE_SLABS is set. Must be a power of two
+  between 1024 and 4096.
+
+SLAB_REGION_SIZE         default: 256MB (16MB on 32-bit systems)
+  The size of the address range reserved for slabs if USE_SLABS is
+  set. Only the parts that are used take up memory or count against
+  the commit limit, except on systems without MAP_ANONYMOUS (and on
+  WIN32), where the whole range is committed when reserved. Committed
+  slabs are not returned to the system.
+
+USE_THREAD_CACHE         default: 0 (false)
+  If true, malloc and free (but not the mspace versions) keep a small
+  per-thread cache of chunks for requests of at most MAX_SMALL_REQUEST
+  bytes. Cache hits are served without locking. Misses refill, and
+  overflows flush, THREAD_CACHE_BATCH chunks at a time under a single
+  lock acquisition. Cached chunks remain marked as in use, so they are
+  reported as such by mallinfo and malloc_stats. A thread's cache is
+  returned to the heap when the thread exits or calls malloc_trim.
+  This requires pthreads and compiler support for thread-local
+  storage (see THREAD_LOCAL), so is not supported on WIN32.
+
+THREAD_CACHE_MAX         default: 32
+  The maximum number of chunks held for each small size in each
+  thread's cache when USE_THREAD_CACHE is set.
+
+THREAD_CACHE_BATCH       default: 16
+  The number of chunks moved between a thread's cache and the heap
+  on each refill or flush. Must be between 1 and THREAD_CACHE_MAX.
+
+USE_PERCPU_CACHE         default: 0 (false)
+  If true, malloc and free (but not the mspace versions) keep a cache
+  of small chunks for each processor, used by whichever thread is
+  running on it as reported by sched_getcpu (which on recent Linux
+  systems just reads the kernel's restartable sequence area). Each
+  cache has its own lock that is only ever tried, never waited for: a
+  thread finding it busy, say because its holder was preempted or
+  migrated, just uses the normal locked path instead. Otherwise this
+  behaves like USE_THREAD_CACHE, but total cached memory is bounded by
+  the number of processors rather than threads, and nothing is needed
+  at thread exit. The caches are mmapped on initialization, and are
+  bypassed if this fails. malloc_trim returns all caches not in use
+  at the time to the heap. This is supported only on Linux, and may
+  not be combined with USE_THREAD_CACHE.
+
+PERCPU_CACHE_MAX         default: 32
+  The maximum number of chunks held for each small size in each
+  processor's cache when USE_PERCPU_CACHE is set.
+
+PERCPU_CACHE_BATCH       default: 16
+  The number of chunks moved between a processor's cache and the heap
+  on each refill or flush. Must be between 1 and PERCPU_CACHE_MAX.
+
+USE_ARENAS               default: 0 (false)
+  If true, malloc and related routines spread threads across up to
+  MAX_ARENAS independent malloc_states ("arenas"), so that threads
+  mostly contend for different locks. Each thread is assigned an arena
+  round-robin. When that arena's lock is busy, the others are tried
+  (and created if necessary) before waiting, and the first one found
+  free becomes the thread's arena. Chunks are always freed back to the
+  arena they came from, as found via FOOTERS. Arenas other than the
+  main one are locked mspaces, so this requires USE_LOCKS, and
+  requires (and by default turns on) MSPACES and FOOTERS. The
+  malloc_footprint, mallinfo, malloc_stats, malloc_trim and
+  malloc_inspect_all routines cover all arenas, while
+  malloc_set_footprint_limit applies to each arena separately.
+
+MAX_ARENAS               default: 16
+  The maximum number of arenas when USE_ARENAS is set.
+
+DEFAULT_ARENAS           default: 0 (number of processors)
+      Also settable using mallopt(M_ARENAS, x)
+  The number of arenas that threads are spread across when USE_ARENAS
+  is set. Zero means to use the number of online processors, but no
+  more than MAX_ARENAS. Lowering this later does not release existing
+  arenas, but threads move off those above the new limit.
+
+USE_NUMA                 default: 0 (false)
+  If true, create_mspace_on_node creates an mspace whose memory is
+  bound to a given NUMA node: each segment and directly mmapped chunk
+  obtained for it is passed to mbind(NUMA_POLICY) before first use.
+  If USE_ARENAS is also set, there is one arena per node rather than
+  per processor: arena i (the main space for node 0) is bound to node
+  i, each thread uses the arena of the node it first allocates on,
+  and threads are not moved to other arenas when theirs is busy.
+  malloc_node_footprint reports the memory held for each node. On
+  single-node machines, or if mbind fails, memory is simply left
+  unbound. The slab region of USE_SLABS is shared and never bound.
+  Requires MSPACES, and is supported only on Linux.
+
+NUMA_POLICY              default: 1 (MPOL_PREFERRED)
+  The mbind mode used if USE_NUMA is set. With the default, memory
+  comes from other nodes when the bound node has none free; use 2
+  (MPOL_BIND) to fail instead.
+
+USE_RESERVED_MSPACES     default: 0 (false)
+  If true, create_mspace_reserved creates an mspace that reserves a
+  given amount of address space up front, inaccessible and without
+  committing memory, and commits it with mprotect in granularity units
+  as the space grows. The space keeps a single contiguous segment, so
+  growth does not map new segments until the reservation is used up,
+  and trimming top decommits pages (madvise and mprotect) without
+  giving up the reservation. Requires MSPACES and MAP_ANONYMOUS, and
+  is not supported on WIN32.
+
+USE_FILE_MSPACES         default: 0 (false)
+  If true, create_mspace_with_file creates an mspace in a file that is
+  mapped shared into memory and holds the malloc_state, bins and all
+  chunks, and open_mspace_file maps the file again at the same address
+  in a later run, so that the space and what was allocated in it can
+  be used without being rebuilt. close_mspace_file writes the space
+  back and marks the file as cleanly closed. A file that was not
+  closed cleanly, was made by another version or configuration of
+  this malloc, or cannot be mapped at its recorded address, is
+  rejected. The space never grows beyond the file and does not
+  separately mmap large chunks or use slabs; mspace_set_footprint_limit
+  refuses it and mspace_track_large_chunks cannot turn mmapping on.
+  Pointers kept in it should only point into it. Requires MSPACES and HAVE_MMAP, and is not supported
+  on WIN32.
+
+USE_SHARED_MSPACES       default: 0 (false)
+  If true, create_shared_mspace creates a locked mspace in memory
+  shared between processes, such as a shm_open or MAP_SHARED region,
+  mapped at the same address in each of them (for example, mapped
+  before forking). Its lock is shared between processes: with pthread
+  locks (USE_SPIN_LOCKS=0) it is a robust process-shared mutex, taken
+  over if its owner dies (though the space may then be corrupt), and
+  futex locks wait with shared futexes. Its magic is a fixed value
+  stored in the space, and with FOOTERS chunk footers are encoded with
+  it, so that every process can check the space and, using free,
+  realloc etc., find it from a chunk; without FOOTERS, use the mspace
+  routines. Because that magic is not secret, FOOTERS guards less
+  well against corrupted or forged footers in programs built with
+  this option: a footer with bit 2 set is decoded with the public
+  magic, and is accepted if it leads to a malloc_state that is marked
+  shared and sits at the start of its own segment. The space never
+  grows beyond its initial capacity and does not separately mmap large
+  chunks or use slabs, which would be private to one process;
+  mspace_set_footprint_limit refuses it. attach_shared_mspace returns
+  the space in a region from another process. Requires MSPACES and
+  built-in, non-recursive locks, and is not supported on WIN32.
+
+USE_PREFAULT_MSPACES     default: 0 (false)
+  If true, mspace_prefault sets per-space flags for latency-critical
+  spaces. With MSPACE_PREFAULT, memory the space gets from the system
+  (new segments, and extensions of top) is populated when obtained,
+  along with the current top, so that later allocations do not stall
+  on first-touch page faults; page purging skips the space. With
+  MSPACE_MLOCK, the segments of the space are also locked in memory
+  with mlock (subject to RLIMIT_MEMLOCK), and mspace_locked_footprint
+  reports how much is locked. Directly mmapped large chunks are
+  neither populated nor locked; raise the mmap threshold or use
+  mspace_track_large_chunks to keep them in segments. Requires MSPACES
+  and HAVE_MMAP, and is not supported on WIN32.
+
+USE_PRESSURE_HANDLERS    default: 0 (false)
+  If true, mspace_set_pressure_handler (or, for malloc and its arenas,
+  malloc_set_pressure_handler) registers a function that a space with
+  a footprint limit calls, with the space unlocked, as its footprint
+  reaches given fractions of the limit, and again when an allocation
+  is about to fail at the limit, so that the program can shrink
+  caches and the like before memory runs out. If the handler
+  reports that it released memory, the failing allocation is retried.
+  The handler is a pointer into the registering process, so it is not
+  kept when a file mspace is reopened, and cannot be set for shared
+  mspaces. Requires MSPACES.
+
+USE_RESIDENT_BYTES       default: 0 (false)
+  If true, malloc_resident_bytes and mspace_resident_bytes report how
+  many bytes of the segments of the heap or a space are resident in
+  memory, using mincore, as opposed to the footprint, which also
+  counts purged, trimmed-but-mapped and never-touched pages. Segments
+  are examined a few at a time, holding the lock only to find them,
+  so the result is approximate while other threads use the heap.
+  Directly mmapped chunks are not included. Requires HAVE_MMAP, and is
+  not supported on WIN32.
+
+USE_REMOTE_FREES         default: 0 (false)
+  If true, an mspace created without locking may have chunks freed
+  into it (via mspace_free, or free if FOOTERS is set) by threads other
+  than its owner. The owner is the thread that created the mspace, or
+  later the thread that most recently allocated from it. Frees by other
+  threads just push the chunk onto a lock-free list in the mspace, and
+  the owner releases all pending chunks on its next call to
+  mspace_malloc or mspace_trim. All other operations, including
+  realloc and bulk_free, must still be performed only by the owner.
+  Requires MSPACES and atomic compare-and-swap (gcc >= 4.1, or MSC).
+
+USE_THREAD_MSPACES       default: 0 (false)
+  If true, thread_mspace() returns an mspace private to the calling
+  thread, creating it on first use. When the thread exits, its mspace
+  is destroyed if nothing in it is in use, and is otherwise kept as an
+  "orphan", so chunks still held by other threads remain valid and
+  can be freed (via free or mspace_free, using FOOTERS). The next
+  thread needing an mspace adopts an orphan, if there is one, rather
+  than creating a new space, and an orphan is destroyed as soon as the
+  last of its chunks is freed. Thread mspaces are locked, so this
+  requires USE_LOCKS and pthreads (so is not supported on WIN32), and
+  requires (and by default turns on) MSPACES and FOOTERS.
+
+THREAD_LOCAL             default: __thread (__declspec(thread) for MSC)
+  The storage class specifier for thread-local variables, used only
+  if USE_THREAD_CACHE, USE_ARENAS or USE_THREAD_MSPACES is set.
+
 FOOTERS                  default: 0
   If true, provide extra checking and dispatching by placing
   information in the footers of allocated chunks. This adds
@@ -381,6 +650,14 @@ NO_SEGMENT_TRAVERSAL       default: 0
   merging of segments that are contiguous, and selectively
   releasing them to the OS if unused, but bounds execution times.
 
+USE_SEGMENT_INDEX          default: 0 (false)
+  If true, once a space has more than one segment it also keeps its
+  segments in an array sorted by base address, held in memory mapped
+  separately, so that finding the segment holding an address and
+  finding segments to merge with take logarithmic rather than linear
+  time. If the array cannot be grown, lookups walk the segment list
+  until the next segment is added. Requires HAVE_MMAP.
+
 HAVE_MMAP                 default: 1 (true)
   True if this system supports mmap or an emulation of it.  If so, and
   HAVE_MORECORE is not true, MMAP is used for all system
@@ -446,6 +723,7 @@ LACKS_STDLIB_H LACKS_SCHED_H LACKS_TIME_H  default: NOT defined unless on WIN32
 
 DEFAULT_GRANULARITY        default: page size if MORECORE_CONTIGUOUS,
                                 system_info.dwAllocationGranularity in WIN32,
+                                HUGE_PAGE_SIZE if USE_HUGE_PAGES,
                                 otherwise 64K.
       Also settable using mallopt(M_GRANULARITY, x)
   The unit for allocating and deallocating memory from the system.  On
@@ -459,6 +737,23 @@ DEFAULT_GRANULARITY        default: page size if MORECORE_CONTIGUOUS,
   versions of malloc, the equivalent of this option was called
   "TOP_PAD")
 
+USE_HUGE_PAGES           default: 0 (false)
+  If true, segments are mapped at HUGE_PAGE_SIZE boundaries, and
+  madvise(MADV_HUGEPAGE) is applied to them where available, so that
+  the system can back them with transparent huge pages. The
+  granularity is then at least HUGE_PAGE_SIZE (including when set via
+  mallopt), so segments are grown, trimmed and released only in whole
+  huge pages. The main space also uses mmap rather than MORECORE,
+  which only falls back to it if mmap fails. Chunks mapped directly
+  for large requests are unaffected. Note that each mspace, including
+  each arena, then takes at least one huge page. Requires HAVE_MMAP,
+  and that MUNMAP can release part of a mapping, so is not supported
+  on WIN32.
+
+HUGE_PAGE_SIZE           default: 2MB
+  The size and alignment of huge pages if USE_HUGE_PAGES is set. Must
+  be a power of two.
+
 DEFAULT_TRIM_THRESHOLD    default: 2MB
       Also settable using mallopt(M_TRIM_THRESHOLD, x)
   The maximum amount of unused top-most memory to keep before
@@ -506,6 +801,101 @@ DEFAULT_MMAP_THRESHOLD       default: 256K
   empirically derived value that works well in most systems. You can
   disable mmap by setting to MAX_SIZE_T.
 
+USE_ADAPTIVE_MMAP_THRESHOLD default: 0 (false)
+  If true, freeing a directly mmapped chunk larger than the current
+  mmap threshold, but no larger than DEFAULT_MMAP_THRESHOLD_MAX,
+  raises the mmap threshold to the chunk's size, and the trim
+  threshold to twice that, so that buffers of that size that are
+  repeatedly allocated and freed are served from the heap thereafter.
+  Setting M_MMAP_THRESHOLD or M_TRIM_THRESHOLD using mallopt turns
+  adaptation off, and setting M_MMAP_THRESHOLD_MAX turns it back on.
+  The number of adjustments is reported by malloc_stats.
+
+DEFAULT_MMAP_THRESHOLD_MAX default: 4M*sizeof(size_t)
+      Also settable using mallopt(M_MMAP_THRESHOLD_MAX, x)
+  The largest mmap threshold set by adaptation if
+  USE_ADAPTIVE_MMAP_THRESHOLD is set.
+
+USE_REALLOC_MMAP         default: 0 (false)
+  If true, when realloc cannot grow a chunk in the heap in place, and
+  the new size is at least the mmap threshold, the chunk is moved into
+  its own mapping rather than to another place in the heap. It is
+  copied once, and further growth then uses mremap (if HAVE_MREMAP)
+  to move pages rather than copying bytes.
+
+USE_MMAP_CACHE           default: 0 (false)
+  If true, directly mmapped chunks are not unmapped when freed, but
+  kept in a small per-space cache, from which later large requests
+  needing a region of the same size, or at most a quarter larger, are
+  served without system calls or page faults. Cached regions still
+  count toward the footprint and footprint limit, and are unmapped
+  when evicted to make room, when not reused within MMAP_CACHE_MAX_AGE
+  later direct mmaps and frees, when the footprint limit would
+  otherwise be reached, and by malloc_trim, destroy_mspace and (if
+  USE_BACKGROUND_PURGE) the background purger. calloc clears reused
+  regions. Requires HAVE_MMAP.
+
+MMAP_CACHE_SLOTS         default: 8
+  The maximum number of regions cached by each space if USE_MMAP_CACHE
+  is set.
+
+MMAP_CACHE_MAX           default: 32MB
+  The maximum total size of the regions cached by each space if
+  USE_MMAP_CACHE is set. Larger regions are never cached.
+
+MMAP_CACHE_MAX_AGE       default: 64
+  The number of direct mmaps and frees by a space after which a cached
+  region not reused in the meantime is unmapped, if USE_MMAP_CACHE is
+  set.
+
+USE_PAGE_PURGING         default: 0 (false)
+  If true, the whole pages inside large binned free chunks (which,
+  unlike top, cannot be trimmed) are returned to the system using
+  madvise(PURGE_ADVICE), while the chunks remain available for reuse.
+  This is done in passes over the binned chunks of at least
+  PURGE_MIN_SIZE bytes, run whenever DEFAULT_PURGE_THRESHOLD bytes
+  have been freed into large chunks since the last pass, and by
+  malloc_trim. Purged chunks are marked so that later passes skip
+  them, until they are merged, split or reused. With USE_HUGE_PAGES,
+  only whole huge pages are purged. Chunks in the initial space of
+  create_mspace_with_base are never purged. Requires HAVE_MMAP and
+  madvise, so is not supported on WIN32.
+
+PURGE_ADVICE             default: MADV_DONTNEED
+  The advice passed to madvise to purge pages if USE_PAGE_PURGING is
+  set. MADV_FREE, where available, is cheaper, but the system then
+  reclaims the pages only when under memory pressure.
+
+PURGE_MIN_SIZE           default: 64K
+  The size of the smallest free chunk purged if USE_PAGE_PURGING is
+  set.
+
+DEFAULT_PURGE_THRESHOLD  default: 1MB
+      Also settable using mallopt(M_PURGE_THRESHOLD, x)
+  The number of bytes freed into large chunks after which a purge pass
+  runs, if USE_PAGE_PURGING is set. Setting to MAX_SIZE_T leaves
+  purging to malloc_trim.
+
+USE_BACKGROUND_PURGE     default: 0 (false)
+  If true, malloc_background_purge and mspace_background_purge enable
+  returning the free memory of a space to the system from a background
+  thread, started when the first space is enabled, rather than (or as
+  well as) from within free. Memory is released on a decay curve: the
+  thread samples each space every DEFAULT_PURGE_DECAY/8 seconds, and
+  trims top only by the amount it has stayed free over the whole decay
+  time. Unused segments are released, and (if USE_PAGE_PURGING) free
+  chunks purged, at most once per decay time. mallopt(M_INLINE_TRIM, 0)
+  stops free from trimming, releasing segments and purging at all, so
+  that none of these system calls are made on the calling thread. Only
+  locked spaces can be handled by the thread. It is not restarted in a
+  child process after fork until a space is next enabled. Requires
+  USE_LOCKS and pthreads, so is not supported on WIN32.
+
+DEFAULT_PURGE_DECAY      default: 10 (seconds)
+      Also settable using mallopt(M_PURGE_DECAY, x)
+  The time free memory must stay unused before the background purger
+  returns it, if USE_BACKGROUND_PURGE is set.
+
 MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
   The number of consolidated frees between checks to release
   unused segments when freeing. When using non-contiguous segments,
@@ -519,6 +909,19 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
   rarely trigger versus holding on to unused memory. To effectively
   disable, set to MAX_SIZE_T. This may lead to a very slight speed
   improvement at the expense of carrying around more memory.
+
+USE_INCREMENTAL_RELEASE  default: 0 (false)
+  If true, free releases unused segments in constant time instead of
+  periodically scanning all segments (so MAX_RELEASE_CHECK_RATE is
+  not used by free). Each large chunk free consolidates is checked for
+  whether it now spans a whole mmapped segment, other than the one
+  holding top. The space remembers the last such segment, and when
+  another is found, unmaps the remembered one if it is still entirely
+  free, so that a segment is not unmapped and mapped again when
+  chunks of the same size are repeatedly freed and allocated.
+  Segments left entirely free in other ways are still released by
+  malloc_trim, and by the background purger if USE_BACKGROUND_PURGE
+  is set, which also disables releasing in free. Requires HAVE_MMAP.
 */
 
 /* Version identifier to allow people to support multiple versions */
@@ -584,11 +987,29 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 /* The maximum possible size_t value has all bits set */
 #define MAX_SIZE_T           (~(size_t)0)
 
-#ifndef USE_LOCKS /* ensure true if spin or recursive locks set */
+#ifndef USE_FUTEX_LOCKS
+#define USE_FUTEX_LOCKS 0
+#endif /* USE_FUTEX_LOCKS */
+
+#ifndef USE_LOCKS /* ensure true if spin, recursive or futex locks set */
 #define USE_LOCKS  ((defined(USE_SPIN_LOCKS) && USE_SPIN_LOCKS != 0) || \
-                    (defined(USE_RECURSIVE_LOCKS) && USE_RECURSIVE_LOCKS != 0))
+                    (defined(USE_RECURSIVE_LOCKS) && USE_RECURSIVE_LOCKS != 0) || \
+                    USE_FUTEX_LOCKS)
 #endif /* USE_LOCKS */
 
+#if USE_FUTEX_LOCKS
+#if !defined(__linux__) || !defined(__GNUC__) || \
+  (__GNUC__ < 4 || (__GNUC__ == 4 && __GNUC_MINOR__ < 1))
+#error "USE_FUTEX_LOCKS requires Linux and gcc >= 4.1"
+#endif /* ... futexes available ... */
+#if defined(USE_RECURSIVE_LOCKS) && USE_RECURSIVE_LOCKS != 0
+#error "USE_FUTEX_LOCKS may not be combined with USE_RECURSIVE_LOCKS"
+#endif /* USE_RECURSIVE_LOCKS */
+#if USE_LOCKS > 1
+#error "USE_FUTEX_LOCKS may not be combined with user-defined locks"
+#endif /* USE_LOCKS > 1 */
+#endif /* USE_FUTEX_LOCKS */
+
 #if USE_LOCKS /* Spin locks for gcc >= 4.1, older gcc on x86, MSC >= 1310 */
 #if ((defined(__GNUC__) &&                                              \
       ((__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1)) ||      \
@@ -607,8 +1028,14 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #ifndef ONLY_MSPACES
 #define ONLY_MSPACES 0
 #endif  /* ONLY_MSPACES */
+#ifndef USE_ARENAS
+#define USE_ARENAS 0
+#endif  /* USE_ARENAS */
+#ifndef USE_THREAD_MSPACES
+#define USE_THREAD_MSPACES 0
+#endif  /* USE_THREAD_MSPACES */
 #ifndef MSPACES
-#if ONLY_MSPACES
+#if ONLY_MSPACES || USE_ARENAS || USE_THREAD_MSPACES
 #define MSPACES 1
 #else   /* ONLY_MSPACES */
 #define MSPACES 0
@@ -618,8 +1045,14 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define MALLOC_ALIGNMENT ((size_t)(2 * sizeof(void *)))
 #endif  /* MALLOC_ALIGNMENT */
 #ifndef FOOTERS
-#define FOOTERS 0
+#define FOOTERS (USE_ARENAS || USE_THREAD_MSPACES)
 #endif  /* FOOTERS */
+#if USE_ARENAS && (ONLY_MSPACES || !MSPACES || !FOOTERS || !USE_LOCKS)
+#error "USE_ARENAS requires USE_LOCKS, MSPACES and FOOTERS"
+#endif  /* USE_ARENAS */
+#if USE_THREAD_MSPACES && (!MSPACES || !FOOTERS || !USE_LOCKS)
+#error "USE_THREAD_MSPACES requires USE_LOCKS, MSPACES and FOOTERS"
+#endif  /* USE_THREAD_MSPACES */
 #ifndef ABORT
 #define ABORT  abort()
 #endif  /* ABORT */
@@ -668,8 +1101,19 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define MORECORE_CONTIGUOUS 1
 #endif  /* MORECORE_CONTIGUOUS */
 #endif  /* HAVE_MORECORE */
+#ifndef USE_HUGE_PAGES
+#define USE_HUGE_PAGES 0
+#endif  /* USE_HUGE_PAGES */
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE ((size_t)2U * (size_t)1024U * (size_t)1024U)
+#endif  /* HUGE_PAGE_SIZE */
+#if USE_HUGE_PAGES && (!HAVE_MMAP || defined(WIN32))
+#error "USE_HUGE_PAGES requires HAVE_MMAP, and is not supported on WIN32"
+#endif  /* USE_HUGE_PAGES */
 #ifndef DEFAULT_GRANULARITY
-#if (MORECORE_CONTIGUOUS || defined(WIN32))
+#if USE_HUGE_PAGES
+#define DEFAULT_GRANULARITY HUGE_PAGE_SIZE
+#elif (MORECORE_CONTIGUOUS || defined(WIN32))
 #define DEFAULT_GRANULARITY (0)  /* 0 means to compute in init_mparams */
 #else   /* MORECORE_CONTIGUOUS */
 #define DEFAULT_GRANULARITY ((size_t)64U * (size_t)1024U)
@@ -689,6 +1133,58 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define DEFAULT_MMAP_THRESHOLD MAX_SIZE_T
 #endif  /* HAVE_MMAP */
 #endif  /* DEFAULT_MMAP_THRESHOLD */
+#ifndef USE_ADAPTIVE_MMAP_THRESHOLD
+#define USE_ADAPTIVE_MMAP_THRESHOLD 0
+#endif  /* USE_ADAPTIVE_MMAP_THRESHOLD */
+#ifndef DEFAULT_MMAP_THRESHOLD_MAX
+#define DEFAULT_MMAP_THRESHOLD_MAX\
+  ((size_t)4U * (size_t)1024U * (size_t)1024U * sizeof(size_t))
+#endif  /* DEFAULT_MMAP_THRESHOLD_MAX */
+#ifndef USE_REALLOC_MMAP
+#define USE_REALLOC_MMAP 0
+#endif  /* USE_REALLOC_MMAP */
+#if USE_REALLOC_MMAP && !HAVE_MMAP
+#error "USE_REALLOC_MMAP requires HAVE_MMAP"
+#endif  /* USE_REALLOC_MMAP */
+#ifndef USE_MMAP_CACHE
+#define USE_MMAP_CACHE 0
+#endif  /* USE_MMAP_CACHE */
+#ifndef MMAP_CACHE_SLOTS
+#define MMAP_CACHE_SLOTS 8
+#endif  /* MMAP_CACHE_SLOTS */
+#ifndef MMAP_CACHE_MAX
+#define MMAP_CACHE_MAX ((size_t)32U * (size_t)1024U * (size_t)1024U)
+#endif  /* MMAP_CACHE_MAX */
+#ifndef MMAP_CACHE_MAX_AGE
+#define MMAP_CACHE_MAX_AGE ((size_t)64U)
+#endif  /* MMAP_CACHE_MAX_AGE */
+#if USE_MMAP_CACHE && !HAVE_MMAP
+#error "USE_MMAP_CACHE requires HAVE_MMAP"
+#endif  /* USE_MMAP_CACHE */
+#ifndef USE_PAGE_PURGING
+#define USE_PAGE_PURGING 0
+#endif  /* USE_PAGE_PURGING */
+#ifndef PURGE_ADVICE
+#define PURGE_ADVICE MADV_DONTNEED
+#endif  /* PURGE_ADVICE */
+#ifndef PURGE_MIN_SIZE
+#define PURGE_MIN_SIZE ((size_t)64U * (size_t)1024U)
+#endif  /* PURGE_MIN_SIZE */
+#ifndef DEFAULT_PURGE_THRESHOLD
+#define DEFAULT_PURGE_THRESHOLD ((size_t)1024U * (size_t)1024U)
+#endif  /* DEFAULT_PURGE_THRESHOLD */
+#if USE_PAGE_PURGING && (!HAVE_MMAP || defined(WIN32))
+#error "USE_PAGE_PURGING requires HAVE_MMAP, and is not supported on WIN32"
+#endif  /* USE_PAGE_PURGING */
+#ifndef USE_BACKGROUND_PURGE
+#define USE_BACKGROUND_PURGE 0
+#endif  /* USE_BACKGROUND_PURGE */
+#ifndef DEFAULT_PURGE_DECAY
+#define DEFAULT_PURGE_DECAY ((size_t)10U)
+#endif  /* DEFAULT_PURGE_DECAY */
+#if USE_BACKGROUND_PURGE && (!USE_LOCKS || defined(WIN32))
+#error "USE_BACKGROUND_PURGE requires USE_LOCKS, and is not supported on WIN32"
+#endif  /* USE_BACKGROUND_PURGE */
 #ifndef MAX_RELEASE_CHECK_RATE
 #if HAVE_MMAP
 #define MAX_RELEASE_CHECK_RATE 4095
@@ -714,6 +1210,155 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #ifndef NO_SEGMENT_TRAVERSAL
 #define NO_SEGMENT_TRAVERSAL 0
 #endif /* NO_SEGMENT_TRAVERSAL */
+#ifndef USE_SEGMENT_INDEX
+#define USE_SEGMENT_INDEX 0
+#endif /* USE_SEGMENT_INDEX */
+#if USE_SEGMENT_INDEX && !HAVE_MMAP
+#error "USE_SEGMENT_INDEX requires HAVE_MMAP"
+#endif /* USE_SEGMENT_INDEX */
+#ifndef USE_INCREMENTAL_RELEASE
+#define USE_INCREMENTAL_RELEASE 0
+#endif /* USE_INCREMENTAL_RELEASE */
+#if USE_INCREMENTAL_RELEASE && !HAVE_MMAP
+#error "USE_INCREMENTAL_RELEASE requires HAVE_MMAP"
+#endif /* USE_INCREMENTAL_RELEASE */
+#ifndef FUTEX_LOCK_SPINS
+#define FUTEX_LOCK_SPINS 100
+#endif /* FUTEX_LOCK_SPINS */
+#ifndef FUTEX_LOCK_FAIR
+#define FUTEX_LOCK_FAIR 0
+#endif /* FUTEX_LOCK_FAIR */
+#ifndef USE_FASTBINS
+#define USE_FASTBINS 0
+#endif /* USE_FASTBINS */
+#ifndef MAX_FAST_SIZE
+#define MAX_FAST_SIZE (64 * sizeof(size_t) / 4)
+#endif /* MAX_FAST_SIZE */
+#ifndef USE_SLABS
+#define USE_SLABS 0
+#endif /* USE_SLABS */
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 32
+#endif /* SLAB_MAX_SIZE */
+#ifndef SLAB_SIZE
+#define SLAB_SIZE 4096
+#endif /* SLAB_SIZE */
+#ifndef SLAB_REGION_SIZE
+#define SLAB_REGION_SIZE ((sizeof(size_t) == 8)? 256U*1024U*1024U : 16U*1024U*1024U)
+#endif /* SLAB_REGION_SIZE */
+#if USE_SLABS
+#if !HAVE_MMAP
+#error "USE_SLABS requires HAVE_MMAP"
+#endif /* HAVE_MMAP */
+#if SLAB_MAX_SIZE < 8 || SLAB_MAX_SIZE > 64 || (SLAB_MAX_SIZE & 7) != 0
+#error "SLAB_MAX_SIZE must be a multiple of 8 between 8 and 64"
+#endif /* SLAB_MAX_SIZE */
+#if (SLAB_SIZE & (SLAB_SIZE - 1)) != 0 || SLAB_SIZE < 1024 || SLAB_SIZE > 4096
+#error "SLAB_SIZE must be a power of two between 1024 and 4096"
+#endif /* SLAB_SIZE */
+#endif /* USE_SLABS */
+#ifndef USE_THREAD_CACHE
+#define USE_THREAD_CACHE 0
+#endif /* USE_THREAD_CACHE */
+#ifndef THREAD_CACHE_MAX
+#define THREAD_CACHE_MAX 32
+#endif /* THREAD_CACHE_MAX */
+#ifndef THREAD_CACHE_BATCH
+#define THREAD_CACHE_BATCH 16
+#endif /* THREAD_CACHE_BATCH */
+#if USE_THREAD_CACHE
+#if THREAD_CACHE_BATCH < 1 || THREAD_CACHE_BATCH > THREAD_CACHE_MAX
+#error "THREAD_CACHE_BATCH must be between 1 and THREAD_CACHE_MAX"
+#endif
+#endif /* USE_THREAD_CACHE */
+#ifndef USE_PERCPU_CACHE
+#define USE_PERCPU_CACHE 0
+#endif /* USE_PERCPU_CACHE */
+#ifndef PERCPU_CACHE_MAX
+#define PERCPU_CACHE_MAX 32
+#endif /* PERCPU_CACHE_MAX */
+#ifndef PERCPU_CACHE_BATCH
+#define PERCPU_CACHE_BATCH 16
+#endif /* PERCPU_CACHE_BATCH */
+#if USE_PERCPU_CACHE
+#if USE_THREAD_CACHE
+#error "USE_PERCPU_CACHE and USE_THREAD_CACHE may not both be set"
+#endif /* USE_THREAD_CACHE */
+#if PERCPU_CACHE_BATCH < 1 || PERCPU_CACHE_BATCH > PERCPU_CACHE_MAX
+#error "PERCPU_CACHE_BATCH must be between 1 and PERCPU_CACHE_MAX"
+#endif
+#endif /* USE_PERCPU_CACHE */
+#ifndef MAX_ARENAS
+#define MAX_ARENAS 16
+#endif /* MAX_ARENAS */
+#ifndef DEFAULT_ARENAS
+#define DEFAULT_ARENAS 0  /* 0 means to compute in init_mparams */
+#endif /* DEFAULT_ARENAS */
+#ifndef USE_NUMA
+#define USE_NUMA 0
+#endif /* USE_NUMA */
+#ifndef NUMA_POLICY
+#define NUMA_POLICY 1  /* MPOL_PREFERRED */
+#endif /* NUMA_POLICY */
+#if USE_NUMA && (!MSPACES || !defined(__linux__))
+#error "USE_NUMA requires MSPACES, and is supported only on Linux"
+#endif /* USE_NUMA */
+#ifndef USE_RESERVED_MSPACES
+#define USE_RESERVED_MSPACES 0
+#endif /* USE_RESERVED_MSPACES */
+#if USE_RESERVED_MSPACES && (!MSPACES || !HAVE_MMAP || defined(WIN32))
+#error "USE_RESERVED_MSPACES requires MSPACES and HAVE_MMAP, and is not supported on WIN32"
+#endif /* USE_RESERVED_MSPACES */
+#ifndef USE_FILE_MSPACES
+#define USE_FILE_MSPACES 0
+#endif /* USE_FILE_MSPACES */
+#if USE_FILE_MSPACES && (!MSPACES || !HAVE_MMAP || defined(WIN32))
+#error "USE_FILE_MSPACES requires MSPACES and HAVE_MMAP, and is not supported on WIN32"
+#endif /* USE_FILE_MSPACES */
+#ifndef USE_SHARED_MSPACES
+#define USE_SHARED_MSPACES 0
+#endif /* USE_SHARED_MSPACES */
+#if USE_SHARED_MSPACES
+#if !MSPACES || USE_LOCKS != 1 || defined(WIN32)
+#error "USE_SHARED_MSPACES requires MSPACES and built-in locks, and is not supported on WIN32"
+#endif /* ... shared locks available ... */
+#if defined(USE_RECURSIVE_LOCKS) && USE_RECURSIVE_LOCKS != 0
+#error "USE_SHARED_MSPACES may not be combined with USE_RECURSIVE_LOCKS"
+#endif /* USE_RECURSIVE_LOCKS */
+#endif /* USE_SHARED_MSPACES */
+#ifndef USE_PREFAULT_MSPACES
+#define USE_PREFAULT_MSPACES 0
+#endif /* USE_PREFAULT_MSPACES */
+#if USE_PREFAULT_MSPACES && (!MSPACES || !HAVE_MMAP || defined(WIN32))
+#error "USE_PREFAULT_MSPACES requires MSPACES and HAVE_MMAP, and is not supported on WIN32"
+#endif /* USE_PREFAULT_MSPACES */
+#ifndef USE_PRESSURE_HANDLERS
+#define USE_PRESSURE_HANDLERS 0
+#endif /* USE_PRESSURE_HANDLERS */
+#if USE_PRESSURE_HANDLERS && !MSPACES
+#error "USE_PRESSURE_HANDLERS requires MSPACES"
+#endif /* USE_PRESSURE_HANDLERS */
+#ifndef USE_RESIDENT_BYTES
+#define USE_RESIDENT_BYTES 0
+#endif /* USE_RESIDENT_BYTES */
+#if USE_RESIDENT_BYTES && (!HAVE_MMAP || defined(WIN32))
+#error "USE_RESIDENT_BYTES requires HAVE_MMAP, and is not supported on WIN32"
+#endif /* USE_RESIDENT_BYTES */
+#ifndef USE_REMOTE_FREES
+#define USE_REMOTE_FREES 0
+#endif /* USE_REMOTE_FREES */
+#if USE_REMOTE_FREES && !MSPACES
+#error "USE_REMOTE_FREES requires MSPACES"
+#endif /* USE_REMOTE_FREES */
+#if USE_THREAD_CACHE || USE_ARENAS || USE_THREAD_MSPACES
+#ifndef THREAD_LOCAL
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else /* _MSC_VER */
+#define THREAD_LOCAL __thread
+#endif /* _MSC_VER */
+#endif /* THREAD_LOCAL */
+#endif /* USE_THREAD_CACHE || USE_ARENAS || USE_THREAD_MSPACES */
 
 /*
   mallopt tuning options.  SVID/XPG defines four standard parameter
@@ -725,6 +1370,11 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define M_TRIM_THRESHOLD     (-1)
 #define M_GRANULARITY        (-2)
 #define M_MMAP_THRESHOLD     (-3)
+#define M_ARENAS             (-4)
+#define M_PURGE_THRESHOLD    (-5)
+#define M_PURGE_DECAY        (-6)
+#define M_INLINE_TRIM        (-7)
+#define M_MMAP_THRESHOLD_MAX (-8)
 
 /* ------------------------ Mallinfo declarations ------------------------ */
 
@@ -835,6 +1485,12 @@ extern "C" {
 #define dlindependent_calloc   independent_calloc
 #define dlindependent_comalloc independent_comalloc
 #define dlbulk_free            bulk_free
+#define dlmalloc_batch         malloc_batch
+#define dlbulk_free_sorted     bulk_free_sorted
+#define dlmalloc_background_purge malloc_background_purge
+#define dlmalloc_node_footprint malloc_node_footprint
+#define dlmalloc_resident_bytes malloc_resident_bytes
+#define dlmalloc_set_pressure_handler malloc_set_pressure_handler
 #endif /* USE_DL_PREFIX */
 
 /*
@@ -959,7 +1615,13 @@ DLMALLOC_EXPORT void* dlvalloc(size_t);
   Symbol            param #  default    allowed param values
   M_TRIM_THRESHOLD     -1   2*1024*1024   any   (-1 disables)
   M_GRANULARITY        -2     page size   any power of 2 >= page size
+                                         (>= HUGE_PAGE_SIZE if USE_HUGE_PAGES)
   M_MMAP_THRESHOLD     -3      256*1024   any   (or 0 if no MMAP support)
+  M_ARENAS             -4   #processors   1 to MAX_ARENAS (if USE_ARENAS)
+  M_PURGE_THRESHOLD    -5     1024*1024   any   (if USE_PAGE_PURGING)
+  M_PURGE_DECAY        -6            10   seconds > 0 (if USE_BACKGROUND_PURGE)
+  M_INLINE_TRIM        -7             1   0 or 1 (if USE_BACKGROUND_PURGE)
+  M_MMAP_THRESHOLD_MAX -8 4M*sizeof(size_t) any  (if USE_ADAPTIVE_MMAP_THRESHOLD)
 */
 DLMALLOC_EXPORT int dlmallopt(int, int);
 
@@ -987,6 +1649,32 @@ DLMALLOC_EXPORT size_t dlmalloc_footprint(void);
 */
 DLMALLOC_EXPORT size_t dlmalloc_max_footprint(void);
 
+#if USE_NUMA
+/*
+  malloc_node_footprint(int node);
+  Returns the number of bytes obtained from the system by the main
+  malloc space and arenas that are bound to the given NUMA node, which
+  is zero for all nodes unless USE_ARENAS is also set. Like
+  malloc_footprint, it does not use locks. Available only if compiled
+  with USE_NUMA.
+*/
+DLMALLOC_EXPORT size_t dlmalloc_node_footprint(int node);
+#endif /* USE_NUMA */
+
+#if USE_RESIDENT_BYTES
+/*
+  malloc_resident_bytes();
+  Returns the number of bytes of the memory obtained from the system
+  for the main malloc space (and arenas) that are resident, as found
+  by mincore. Unlike malloc_footprint, this excludes pages that were
+  purged or never touched, but it also excludes directly mmapped
+  chunks. It takes locks only briefly, a few segments at a time, so
+  the result is approximate while other threads allocate. Available
+  only if compiled with USE_RESIDENT_BYTES.
+*/
+DLMALLOC_EXPORT size_t dlmalloc_resident_bytes(void);
+#endif /* USE_RESIDENT_BYTES */
+
 /*
   malloc_footprint_limit();
   Returns the number of bytes that the heap is allowed to obtain from
@@ -1012,6 +1700,24 @@ DLMALLOC_EXPORT size_t dlmalloc_footprint_limit();
 */
 DLMALLOC_EXPORT size_t dlmalloc_set_footprint_limit(size_t bytes);
 
+#if USE_PRESSURE_HANDLERS
+/*
+  malloc_set_pressure_handler(int (*handler)(void*, size_t, void*),
+                              void* arg, size_t permille);
+  Registers handler for the main malloc space and its arenas, as
+  mspace_set_pressure_handler does for an mspace, with marks and
+  shortfalls measured against the limit set by
+  malloc_set_footprint_limit. The first argument of handler is the
+  space under pressure (the main space or an arena). malloc is not
+  locked during the call, so the handler may free memory, but it
+  should not call malloc. Available only if compiled with
+  USE_PRESSURE_HANDLERS.
+*/
+DLMALLOC_EXPORT void dlmalloc_set_pressure_handler(
+                                   int (*handler)(void*, size_t, void*),
+                                   void* arg, size_t permille);
+#endif /* USE_PRESSURE_HANDLERS */
+
 #if MALLOC_INSPECT_ALL
 /*
   malloc_inspect_all(void(*handler)(void *start,
@@ -1181,6 +1887,23 @@ DLMALLOC_EXPORT void** dlindependent_calloc(size_t, size_t, void**);
 */
 DLMALLOC_EXPORT void** dlindependent_comalloc(size_t, size_t*, void**);
 
+/*
+  malloc_batch(size_t n, size_t n_elements, void* chunks[]);
+
+  malloc_batch allocates n_elements chunks of at least n bytes each,
+  storing pointers to them in the chunks array, which must be of at
+  least n_elements in length. It returns the number of chunks
+  allocated, which is less than n_elements only if space ran out.
+  Unlike independent_calloc, the chunks are ordinary ones, allocated
+  just as if by separate calls to malloc (so large ones may be
+  separately mmapped), and nothing is cleared. But all of them are
+  obtained under a single lock acquisition, and small ones are carved
+  in a row from the same bin, dv or top chunk, which is usually much
+  faster than calling malloc n_elements times. They may be freed
+  individually, or all at once using bulk_free.
+*/
+DLMALLOC_EXPORT size_t dlmalloc_batch(size_t, size_t, void**);
+
 /*
   bulk_free(void* array[], size_t n_elements)
   Frees and clears (sets to null) each non-null pointer in the given
@@ -1188,10 +1911,22 @@ DLMALLOC_EXPORT void** dlindependent_comalloc(size_t, size_t*, void**);
   If footers are used, pointers that have been allocated in different
   mspaces are not freed or cleared, and the count of all such pointers
   is returned.  For large arrays of pointers with poor locality, it
-  may be worthwhile to sort this array before calling bulk_free.
+  may be worthwhile to sort this array before calling bulk_free, as
+  bulk_free_sorted does.
 */
 DLMALLOC_EXPORT size_t  dlbulk_free(void**, size_t n_elements);
 
+/*
+  bulk_free_sorted(void* array[], size_t n_elements)
+  Like bulk_free, but first sorts the array by address, using scratch
+  space allocated from the heap, so that each run of chunks that are
+  adjacent in memory is coalesced into a single free chunk before
+  being binned. This is much faster than bulk_free for tearing down
+  large linked structures whose nodes were allocated together. The
+  order of any pointers left in the array is unspecified.
+*/
+DLMALLOC_EXPORT size_t  dlbulk_free_sorted(void**, size_t n_elements);
+
 /*
   pvalloc(size_t n);
   Equivalent to valloc(minimum-page-that-holds(n)), that is,
@@ -1218,10 +1953,28 @@ DLMALLOC_EXPORT void*  dlpvalloc(size_t);
   trailing space to service future expected allocations without having
   to re-obtain memory from the system.
 
+  If compiled with USE_PAGE_PURGING, malloc_trim also purges the pages
+  inside large free chunks, regardless of M_PURGE_THRESHOLD.
+  If compiled with USE_MMAP_CACHE, it also unmaps all cached regions.
+
   Malloc_trim returns 1 if it actually released any memory, else 0.
 */
 DLMALLOC_EXPORT int  dlmalloc_trim(size_t);
 
+#if USE_BACKGROUND_PURGE
+/*
+  malloc_background_purge(int enable);
+  Enables or disables returning the free memory of the main malloc
+  space (and of any arenas) to the system from a background thread,
+  which releases only memory that has stayed unused for the decay time
+  set by mallopt(M_PURGE_DECAY). The thread is started on first use.
+  Returns the previous setting; if the thread cannot be started, the
+  setting is left unchanged. Available only if compiled with
+  USE_BACKGROUND_PURGE.
+*/
+DLMALLOC_EXPORT int dlmalloc_background_purge(int);
+#endif /* USE_BACKGROUND_PURGE */
+
 /*
   malloc_stats();
   Prints on stderr the amount of space obtained from the system (both
@@ -1240,6 +1993,9 @@ DLMALLOC_EXPORT int  dlmalloc_trim(size_t);
 
   malloc_stats prints only the most commonly interesting statistics.
   More information can be obtained by calling mallinfo.
+
+  If compiled with USE_ADAPTIVE_MMAP_THRESHOLD, malloc_stats also prints
+  the current mmap threshold and the number of times it was adjusted.
 */
 DLMALLOC_EXPORT void  dlmalloc_stats(void);
 
@@ -1282,6 +2038,31 @@ typedef void* mspace;
 */
 DLMALLOC_EXPORT mspace create_mspace(size_t capacity, int locked);
 
+#if USE_NUMA
+/*
+  create_mspace_on_node behaves as create_mspace, except that all
+  memory obtained from the system for the space, including its initial
+  capacity, is bound to the given NUMA node. A negative node leaves
+  the memory unbound. Available only if compiled with USE_NUMA.
+*/
+DLMALLOC_EXPORT mspace create_mspace_on_node(size_t capacity, int locked,
+                                             int node);
+#endif /* USE_NUMA */
+
+#if USE_RESERVED_MSPACES
+/*
+  create_mspace_reserved behaves as create_mspace, except that it
+  reserves reserve bytes of address space for the space up front, of
+  which only capacity bytes are initially committed. The space grows
+  by committing more of the reservation, and malloc_trim returns pages
+  at its top to the system while keeping them reserved. Once the
+  reservation is used up, the space grows as others do. Available only
+  if compiled with USE_RESERVED_MSPACES.
+*/
+DLMALLOC_EXPORT mspace create_mspace_reserved(size_t reserve,
+                                              size_t capacity, int locked);
+#endif /* USE_RESERVED_MSPACES */
+
 /*
   destroy_mspace destroys the given space, and attempts to return all
   of its memory back to the system, returning the total number of
@@ -1301,6 +2082,57 @@ DLMALLOC_EXPORT size_t destroy_mspace(mspace msp);
 */
 DLMALLOC_EXPORT mspace create_mspace_with_base(void* base, size_t capacity, int locked);
 
+#if USE_FILE_MSPACES
+/*
+  create_mspace_with_file creates (or truncates) the file at path,
+  sizes it to capacity rounded up to a page, and makes an mspace in a
+  shared mapping of it, or returns null on failure. The space can
+  never grow beyond the file. Chunks keep their addresses when the
+  file is reopened, so for example the first chunk allocated in the
+  space can hold pointers to the rest. Available only if compiled
+  with USE_FILE_MSPACES.
+*/
+DLMALLOC_EXPORT mspace create_mspace_with_file(const char* path,
+                                               size_t capacity, int locked);
+
+/*
+  open_mspace_file maps a file written by close_mspace_file at the
+  address it was created at, and returns its mspace, with all chunks
+  allocated in it still allocated. It returns null if the file cannot
+  be mapped there, was not closed cleanly, or was made by another
+  version or configuration of this malloc. Available only if compiled
+  with USE_FILE_MSPACES.
+*/
+DLMALLOC_EXPORT mspace open_mspace_file(const char* path);
+
+/*
+  close_mspace_file writes back a space made by create_mspace_with_file
+  or open_mspace_file, marks its file as cleanly closed, and unmaps it,
+  returning 0 on success. Using the space afterwards is undefined, as
+  after destroy_mspace (which discards a file space without marking it
+  closed). Available only if compiled with USE_FILE_MSPACES.
+*/
+DLMALLOC_EXPORT int close_mspace_file(mspace msp);
+#endif /* USE_FILE_MSPACES */
+
+#if USE_SHARED_MSPACES
+/*
+  create_shared_mspace behaves as create_mspace_with_base with locking,
+  except that the space, placed in memory shared between processes
+  that map it at the same address, can be used by all of them. The
+  space never grows beyond capacity. Available only if compiled with
+  USE_SHARED_MSPACES.
+*/
+DLMALLOC_EXPORT mspace create_shared_mspace(void* base, size_t capacity);
+
+/*
+  attach_shared_mspace returns the space that create_shared_mspace
+  made at base, typically in another process, or null if there is
+  none. Available only if compiled with USE_SHARED_MSPACES.
+*/
+DLMALLOC_EXPORT mspace attach_shared_mspace(void* base);
+#endif /* USE_SHARED_MSPACES */
+
 /*
   mspace_track_large_chunks controls whether requests for large chunks
   are allocated in their own untracked mmapped regions, separate from
@@ -1314,6 +2146,76 @@ DLMALLOC_EXPORT mspace create_mspace_with_base(void* base, size_t capacity, int
 */
 DLMALLOC_EXPORT int mspace_track_large_chunks(mspace msp, int enable);
 
+#if USE_BACKGROUND_PURGE
+/*
+  mspace_background_purge controls whether the free memory of this
+  space is returned to the system by the background purger, as for
+  malloc_background_purge. Only locked spaces can be purged in the
+  background; for others it does nothing and returns 0. The space is
+  removed from the purger when destroyed. The function returns the
+  previous setting. Available only if compiled with
+  USE_BACKGROUND_PURGE.
+*/
+DLMALLOC_EXPORT int mspace_background_purge(mspace msp, int enable);
+#endif /* USE_BACKGROUND_PURGE */
+
+#if USE_PREFAULT_MSPACES
+#define MSPACE_PREFAULT      (1)
+#define MSPACE_MLOCK         (2)
+
+/*
+  mspace_prefault sets the prefaulting flags of this space, a
+  combination of MSPACE_PREFAULT, to populate memory as the space
+  obtains it (and its current top right away), and MSPACE_MLOCK, to
+  also lock its segments in memory; 0 turns both off, unlocking the
+  segments. Call it right after create_mspace to cover the whole
+  space. The function returns the previous flags. Available only if
+  compiled with USE_PREFAULT_MSPACES.
+*/
+DLMALLOC_EXPORT int mspace_prefault(mspace msp, int flags);
+
+/*
+  mspace_locked_footprint returns the number of bytes of the segments
+  of this space that are locked in memory by MSPACE_MLOCK. Available
+  only if compiled with USE_PREFAULT_MSPACES.
+*/
+DLMALLOC_EXPORT size_t mspace_locked_footprint(mspace msp);
+#endif /* USE_PREFAULT_MSPACES */
+
+#if USE_PRESSURE_HANDLERS
+/*
+  mspace_set_pressure_handler registers handler, called with msp, a
+  shortfall and arg, to relieve memory pressure in a space with a
+  footprint limit (see mspace_set_footprint_limit). It is called with
+  a shortfall of 0 each time the footprint grows past a multiple of
+  permille thousandths of the limit (never, if permille is 0), and
+  with the number of bytes the request lacks when an allocation would
+  fail at the limit. The space is not locked during the call, so the
+  handler may free chunks of the space, but it should not allocate
+  from it. If the handler returns nonzero after a failure, the
+  allocation is retried once. A null handler removes it. Handlers are
+  not kept by files reopened with open_mspace_file, and cannot be set
+  for spaces made by create_shared_mspace. Available only if compiled
+  with USE_PRESSURE_HANDLERS.
+*/
+DLMALLOC_EXPORT void mspace_set_pressure_handler(mspace msp,
+                                   int (*handler)(mspace, size_t, void*),
+                                   void* arg, size_t permille);
+#endif /* USE_PRESSURE_HANDLERS */
+
+#if USE_THREAD_MSPACES
+/*
+  thread_mspace returns the calling thread's mspace, creating it (or
+  adopting an orphaned one) on first use, or 0 if none could be made.
+  The space is locked, so chunks allocated from it may be freed by
+  any thread. It must not be passed to destroy_mspace: when the thread
+  exits, it is destroyed if empty, and otherwise kept until the last
+  of its chunks is freed or another thread adopts it. Available only
+  if compiled with USE_THREAD_MSPACES.
+*/
+DLMALLOC_EXPORT mspace thread_mspace(void);
+#endif /* USE_THREAD_MSPACES */
+
 
 /*
   mspace_malloc behaves as malloc, but operates within
@@ -1368,6 +2270,20 @@ DLMALLOC_EXPORT void** mspace_independent_calloc(mspace msp, size_t n_elements,
 DLMALLOC_EXPORT void** mspace_independent_comalloc(mspace msp, size_t n_elements,
                                    size_t sizes[], void* chunks[]);
 
+/*
+  mspace_malloc_batch behaves as malloc_batch, but operates within
+  the given space.
+*/
+DLMALLOC_EXPORT size_t mspace_malloc_batch(mspace msp, size_t bytes,
+                                           size_t n_elements, void* chunks[]);
+
+/*
+  mspace_bulk_free_sorted behaves as bulk_free_sorted, but operates
+  within the given space.
+*/
+DLMALLOC_EXPORT size_t mspace_bulk_free_sorted(mspace msp, void* array[],
+                                               size_t n_elements);
+
 /*
   mspace_footprint() returns the number of bytes obtained from the
   system for this space.
@@ -1380,6 +2296,15 @@ DLMALLOC_EXPORT size_t mspace_footprint(mspace msp);
 */
 DLMALLOC_EXPORT size_t mspace_max_footprint(mspace msp);
 
+#if USE_RESIDENT_BYTES
+/*
+  mspace_resident_bytes() returns the number of bytes of the segments
+  of this space that are resident, as malloc_resident_bytes does for
+  the main space. Available only if compiled with USE_RESIDENT_BYTES.
+*/
+DLMALLOC_EXPORT size_t mspace_resident_bytes(mspace msp);
+#endif /* USE_RESIDENT_BYTES */
+
 
 #if !NO_MALLINFO
 /*
@@ -1496,7 +2421,10 @@ extern void*     sbrk(ptrdiff_t);
 #elif !defined(LACKS_SCHED_H)
 #include <sched.h>
 #endif /* solaris or LACKS_SCHED_H */
-#if (defined(USE_RECURSIVE_LOCKS) && USE_RECURSIVE_LOCKS != 0) || !USE_SPIN_LOCKS
+#if USE_FUTEX_LOCKS
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#elif (defined(USE_RECURSIVE_LOCKS) && USE_RECURSIVE_LOCKS != 0) || !USE_SPIN_LOCKS
 #include <pthread.h>
 #endif /* USE_RECURSIVE_LOCKS ... */
 #elif defined(_MSC_VER)
@@ -1522,9 +2450,47 @@ LONG __cdecl _InterlockedExchange(LONG volatile *Target, LONG Value);
 #else /* USE_LOCKS */
 #endif /* USE_LOCKS */
 
+#if USE_THREAD_CACHE
+#ifdef WIN32
+#error "USE_THREAD_CACHE requires pthreads"
+#endif /* WIN32 */
+#include <pthread.h>    /* for thread exit handlers */
+#endif /* USE_THREAD_CACHE */
+#if USE_THREAD_MSPACES
+#ifdef WIN32
+#error "USE_THREAD_MSPACES requires pthreads"
+#endif /* WIN32 */
+#include <pthread.h>    /* for thread exit handlers */
+#endif /* USE_THREAD_MSPACES */
+#if USE_BACKGROUND_PURGE
+#include <pthread.h>    /* for the purger thread */
+#endif /* USE_BACKGROUND_PURGE */
+#if USE_NUMA
+#include <sys/syscall.h> /* for mbind and getcpu */
+#include <fcntl.h>      /* for reading the node count */
+#endif /* USE_NUMA */
+#if USE_FILE_MSPACES
+#include <sys/stat.h>   /* for fstat */
+#endif /* USE_FILE_MSPACES */
+#if USE_REMOTE_FREES && !defined(WIN32)
+#include <pthread.h>    /* for pthread_self */
+#endif /* USE_REMOTE_FREES */
+#if USE_PERCPU_CACHE
+#ifndef __linux__
+#error "USE_PERCPU_CACHE is supported only on Linux"
+#endif /* __linux__ */
+#include <sched.h>
+#ifndef __USE_GNU
+extern int sched_getcpu(void);
+#endif /* __USE_GNU */
+#endif /* USE_PERCPU_CACHE */
+
 #ifndef LOCK_AT_FORK
 #define LOCK_AT_FORK 0
 #endif
+#if LOCK_AT_FORK
+#include <pthread.h>    /* for pthread_atfork */
+#endif /* LOCK_AT_FORK */
 
 /* Declarations for bit scanning on win32 */
 #if defined(_MSC_VER) && _MSC_VER>=1300
@@ -1762,12 +2728,132 @@ static FORCEINLINE int win32munmap(void* ptr, size_t size) {
     #define CALL_MREMAP(addr, osz, nsz, mv)     MFAIL
 #endif /* HAVE_MMAP && HAVE_MREMAP */
 
+/**
+ * Define CALL_SEGMENT_MMAP, used to map the space for segments
+ */
+#if USE_HUGE_PAGES
+/*
+  Map s bytes (a multiple of HUGE_PAGE_SIZE) at a HUGE_PAGE_SIZE
+  boundary, by mapping an extra huge page and unmapping the excess
+  before and after, and advise that the space use huge pages.
+*/
+static void* huge_mmap(size_t s) {
+  char* mp = CMFAIL;
+  if (s + HUGE_PAGE_SIZE > s)
+    mp = (char*)(CALL_MMAP(s + HUGE_PAGE_SIZE));
+  if (mp != CMFAIL) {
+    size_t lead = (HUGE_PAGE_SIZE - ((size_t)mp & (HUGE_PAGE_SIZE - SIZE_T_ONE)))
+      & (HUGE_PAGE_SIZE - SIZE_T_ONE);
+    if (lead != 0)
+      (void)CALL_MUNMAP(mp, lead);
+    mp += lead;
+    (void)CALL_MUNMAP(mp + s, HUGE_PAGE_SIZE - lead);
+#ifdef MADV_HUGEPAGE
+    (void)madvise(mp, s, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+  }
+  return mp;
+}
+#define CALL_SEGMENT_MMAP(s)  huge_mmap(s)
+#define MIN_GRANULARITY       HUGE_PAGE_SIZE
+#else /* USE_HUGE_PAGES */
+#define CALL_SEGMENT_MMAP(s)  CALL_MMAP(s)
+#define MIN_GRANULARITY       SIZE_T_ONE
+#endif /* USE_HUGE_PAGES */
+
+/**
+ * Define reserve_mmap/commit_reserved/decommit_reserved
+ */
+#if HAVE_MMAP && !defined(WIN32) && defined(MAP_ANONYMOUS)
+#ifdef MAP_NORESERVE
+#define RESERVE_FLAGS         (MMAP_FLAGS|MAP_NORESERVE)
+#else /* MAP_NORESERVE */
+#define RESERVE_FLAGS         (MMAP_FLAGS)
+#endif /* MAP_NORESERVE */
+
+/* Make reserved pages usable, returning 0 on success */
+#define commit_reserved(a, s)   mprotect((a), (s), MMAP_PROT)
+#endif /* HAVE_MMAP ... */
+
+#if USE_RESERVED_MSPACES
+#ifndef MAP_ANONYMOUS
+#error "USE_RESERVED_MSPACES requires MAP_ANONYMOUS"
+#endif /* MAP_ANONYMOUS */
+
+/*
+  Reserve s bytes of inaccessible address space, aligned as
+  CALL_SEGMENT_MMAP aligns segments, without committing memory to it.
+*/
+static char* reserve_mmap(size_t s) {
+  char* mp = CMFAIL;
+#if USE_HUGE_PAGES
+  if (s + HUGE_PAGE_SIZE > s)
+    mp = (char*)mmap(0, s + HUGE_PAGE_SIZE, PROT_NONE, RESERVE_FLAGS, -1, 0);
+  if (mp != CMFAIL) {
+    size_t lead = (HUGE_PAGE_SIZE - ((size_t)mp & (HUGE_PAGE_SIZE - SIZE_T_ONE)))
+      & (HUGE_PAGE_SIZE - SIZE_T_ONE);
+    if (lead != 0)
+      (void)CALL_MUNMAP(mp, lead);
+    mp += lead;
+    (void)CALL_MUNMAP(mp + s, HUGE_PAGE_SIZE - lead);
+#ifdef MADV_HUGEPAGE
+    (void)madvise(mp, s, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+  }
+#else /* USE_HUGE_PAGES */
+  mp = (char*)mmap(0, s, PROT_NONE, RESERVE_FLAGS, -1, 0);
+#endif /* USE_HUGE_PAGES */
+  return mp;
+}
+
+/* Return reserved pages to the system, keeping the address space */
+static int decommit_reserved(char* a, size_t s) {
+#if USE_PREFAULT_MSPACES
+  (void)munlock(a, s); /* locked pages can be neither dropped nor kept */
+#endif /* USE_PREFAULT_MSPACES */
+  (void)madvise(a, s, MADV_DONTNEED);
+  return mprotect(a, s, PROT_NONE);
+}
+#endif /* USE_RESERVED_MSPACES */
+
 /* mstate bit set if continguous morecore disabled or failed */
 #define USE_NONCONTIGUOUS_BIT (4U)
 
 /* segment bit set in create_mspace_with_base */
 #define EXTERN_BIT            (8U)
 
+/* mstate bit set in unlocked mspaces accepting frees from other threads */
+#define REMOTE_FREE_BIT       (16U)
+
+/* mstate bit set in thread mspaces whose thread has exited */
+#define ORPHAN_BIT            (32U)
+
+/* mstate bit set in spaces handled by the background purger */
+#define PURGE_BIT             (64U)
+
+/* segment bit set in the reserved segment of create_mspace_reserved */
+#define RESERVED_BIT          (128U)
+
+/* segment bit set, with EXTERN_BIT, in the segment of a file mspace */
+#define FILE_BIT              (256U)
+
+/* mstate bit set in spaces made by create_shared_mspace */
+#define SHARED_BIT            (512U)
+
+/* The magic of shared spaces, the same in every process, with bit 2 set */
+#define SHARED_MSPACE_MAGIC   ((size_t)0x5a5a5a5cU)
+
+/* segment bit set in segments locked in memory by MSPACE_MLOCK */
+#define LOCKED_BIT            (1024U)
+
+/* mstate bits set by mspace_prefault for MSPACE_PREFAULT and MSPACE_MLOCK */
+#define PREFAULT_BIT          (2048U)
+#define MLOCK_BIT             (4096U)
+
+/* mstate bit set in spaces confined to their initial memory (file and
+   shared mspaces) */
+#define NO_GROW_BIT           (8192U)
+
 
 /* --------------------------- Lock preliminaries ------------------------ */
 
@@ -1789,7 +2875,8 @@ static FORCEINLINE int win32munmap(void* ptr, size_t size) {
   Because lock-protected regions generally have bounded times, it is
   OK to use the supplied simple spinlocks. Spinlocks are likely to
   improve performance for lightly contended applications, but worsen
-  performance under heavy contention.
+  performance under heavy contention. Futex locks (USE_FUTEX_LOCKS)
+  instead sleep in the kernel after a bounded spin.
 
   If USE_LOCKS is > 1, the definitions of lock routines here are
   bypassed, in which case you will need to define the type MLOCK_T,
@@ -1817,6 +2904,97 @@ static FORCEINLINE int win32munmap(void* ptr, size_t size) {
 /* #define TRY_LOCK(lk) ... */
 /* static MLOCK_T malloc_global_mutex = ... */
 
+#elif USE_FUTEX_LOCKS
+/* -----------------------  Futex-based locks ------------------------ */
+/*
+  The lock word is 0 if free, 1 if held, or 2 if held and some thread
+  may be sleeping on it. Threads that stop spinning mark the lock 2
+  before sleeping, and also keep it at 2 when they get it, since
+  others may still be asleep. So a release only needs to make a
+  system call to wake a sleeper if the lock was 2. With
+  FUTEX_LOCK_FAIR, a sleeper that has been woken that many times
+  without getting the lock marks it 4 instead, and the next release
+  sets it to 3 rather than 0, handing it off to a thread that has
+  already slept at least once. Since the starving thread is one, and
+  stays asleep or awake in futex_acquire_lock until it gets the lock,
+  a handed-off lock is always taken.
+*/
+#if USE_SHARED_MSPACES
+/* Locks of shared mspaces may be waited on in several processes */
+#define futex_wait(addr, val)\
+  syscall(SYS_futex, (addr), FUTEX_WAIT, (val), 0, 0, 0)
+#define futex_wake(addr)\
+  syscall(SYS_futex, (addr), FUTEX_WAKE, 1, 0, 0, 0)
+#else /* USE_SHARED_MSPACES */
+#define futex_wait(addr, val)\
+  syscall(SYS_futex, (addr), FUTEX_WAIT_PRIVATE, (val), 0, 0, 0)
+#define futex_wake(addr)\
+  syscall(SYS_futex, (addr), FUTEX_WAKE_PRIVATE, 1, 0, 0, 0)
+#endif /* USE_SHARED_MSPACES */
+#define futex_cas(sl, from, to)\
+  __sync_bool_compare_and_swap((sl), (from), (to))
+
+#if defined(__i386__) || defined(__x86_64__)
+#define FUTEX_SPIN_PAUSE      __asm__ __volatile__ ("pause" ::: "memory")
+#else /* x86 */
+#define FUTEX_SPIN_PAUSE      __asm__ __volatile__ ("" ::: "memory")
+#endif /* x86 */
+
+static int futex_acquire_lock(int *sl) {
+  int spins, wakes = 0;
+  for (spins = 0; spins < FUTEX_LOCK_SPINS; ++spins) {
+    if (*(volatile int *)sl == 0 && futex_cas(sl, 0, 1))
+      return 0;
+    FUTEX_SPIN_PAUSE;
+  }
+  for (;;) {
+    int s = *(volatile int *)sl;
+    if (s == 0 || (s == 3 && wakes != 0)) {
+      if (futex_cas(sl, s, 2))
+        return 0;
+      continue;
+    }
+#if FUTEX_LOCK_FAIR
+    if (wakes >= FUTEX_LOCK_FAIR && (s == 1 || s == 2)) {
+      if (!futex_cas(sl, s, 4))
+        continue;
+      s = 4;
+    }
+#endif /* FUTEX_LOCK_FAIR */
+    if (s == 1) {
+      if (!futex_cas(sl, 1, 2))
+        continue;
+      s = 2;
+    }
+    futex_wait(sl, s);
+    ++wakes;
+  }
+}
+
+static FORCEINLINE void futex_release_lock(int *sl) {
+#if FUTEX_LOCK_FAIR
+  for (;;) {
+    int s = *(volatile int *)sl;
+    if (futex_cas(sl, s, (s == 4)? 3 : 0)) {
+      if (s != 1)
+        futex_wake(sl);
+      return;
+    }
+  }
+#else /* FUTEX_LOCK_FAIR */
+  if (__sync_fetch_and_and(sl, 0) == 2)
+    futex_wake(sl);
+#endif /* FUTEX_LOCK_FAIR */
+}
+
+#define MLOCK_T               int
+#define TRY_LOCK(sl)          futex_cas(sl, 0, 1)
+#define RELEASE_LOCK(sl)      futex_release_lock(sl)
+#define ACQUIRE_LOCK(sl)      (futex_cas(sl, 0, 1)? 0 : futex_acquire_lock(sl))
+#define INITIAL_LOCK(sl)      (*sl = 0)
+#define DESTROY_LOCK(sl)      (0)
+static MLOCK_T malloc_global_mutex = 0;
+
 #elif USE_SPIN_LOCKS
 
 /* First, define CAS_LOCK and CLEAR_LOCK on ints */
@@ -1999,7 +3177,11 @@ static void init_malloc_global_mutex() {
 
 #else /* pthreads-based locks */
 #define MLOCK_T               pthread_mutex_t
+#if USE_SHARED_MSPACES
+#define ACQUIRE_LOCK(lk)      pthread_acquire_lock(lk)
+#else /* USE_SHARED_MSPACES */
 #define ACQUIRE_LOCK(lk)      pthread_mutex_lock(lk)
+#endif /* USE_SHARED_MSPACES */
 #define RELEASE_LOCK(lk)      pthread_mutex_unlock(lk)
 #define TRY_LOCK(lk)          (!pthread_mutex_trylock(lk))
 #define INITIAL_LOCK(lk)      pthread_init_lock(lk)
@@ -2027,11 +3209,42 @@ static int pthread_init_lock (MLOCK_T *lk) {
   return 0;
 }
 
+#if USE_SHARED_MSPACES
+/* Initialize the lock of a shared mspace, robust where available */
+static int pthread_init_shared_lock (MLOCK_T *lk) {
+  pthread_mutexattr_t attr;
+  if (pthread_mutexattr_init(&attr)) return 1;
+  if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) return 1;
+#ifdef EOWNERDEAD
+  if (pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) return 1;
+#endif /* EOWNERDEAD */
+  if (pthread_mutex_init(lk, &attr)) return 1;
+  if (pthread_mutexattr_destroy(&attr)) return 1;
+  return 0;
+}
+
+/* Acquire a lock, taking it over if a process died holding it */
+static int pthread_acquire_lock (MLOCK_T *lk) {
+  int r = pthread_mutex_lock(lk);
+#ifdef EOWNERDEAD
+  if (r == EOWNERDEAD)
+    r = pthread_mutex_consistent(lk);
+#endif /* EOWNERDEAD */
+  return r;
+}
+#define INITIAL_SHARED_LOCK(lk)  pthread_init_shared_lock(lk)
+#endif /* USE_SHARED_MSPACES */
+
 #endif /* ... lock types ... */
 
 /* Common code for all lock types */
 #define USE_LOCK_BIT               (2U)
 
+#if USE_SHARED_MSPACES && !defined(INITIAL_SHARED_LOCK)
+/* Spin and futex lock words work across processes as they are */
+#define INITIAL_SHARED_LOCK(lk)    INITIAL_LOCK(lk)
+#endif /* USE_SHARED_MSPACES */
+
 #ifndef ACQUIRE_MALLOC_GLOBAL_LOCK
 #define ACQUIRE_MALLOC_GLOBAL_LOCK()  ACQUIRE_LOCK(&malloc_global_mutex);
 #endif
@@ -2042,6 +3255,32 @@ static int pthread_init_lock (MLOCK_T *lk) {
 
 #endif /* USE_LOCKS */
 
+/* ------------------------- Remote free support ------------------------- */
+
+#if USE_REMOTE_FREES
+#ifndef CURRENT_THREAD /* else already defined for recursive locks */
+#ifdef WIN32
+#define THREAD_ID_T           DWORD
+#define CURRENT_THREAD        GetCurrentThreadId()
+#define EQ_OWNER(X,Y)         ((X) == (Y))
+#else /* WIN32 */
+#define THREAD_ID_T           pthread_t
+#define CURRENT_THREAD        pthread_self()
+#define EQ_OWNER(X,Y)         pthread_equal(X, Y)
+#endif /* WIN32 */
+#endif /* CURRENT_THREAD */
+
+/* Pointer compare-and-swap, returning nonzero on success */
+#if defined(__GNUC__)&& (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define CAS_PTR(p, cmp, val)  __sync_bool_compare_and_swap(p, cmp, val)
+#elif defined(_MSC_VER)
+#define CAS_PTR(p, cmp, val)\
+  (InterlockedCompareExchangePointer((PVOID volatile*)(p), (val), (cmp)) == (cmp))
+#else /* ... CAS_PTR ... */
+#error "USE_REMOTE_FREES requires atomic compare-and-swap"
+#endif /* ... CAS_PTR ... */
+#endif /* USE_REMOTE_FREES */
+
 /* -----------------------  Chunk representations ------------------------ */
 
 /*
@@ -2238,7 +3477,10 @@ typedef unsigned int flag_t;           /* The type of various bit flag sets */
   adjacent chunk in use, and or'ed with CINUSE_BIT if this chunk is in
   use, unless mmapped, in which case both bits are cleared.
 
-  FLAG4_BIT is not used by this malloc, but might be useful in extensions.
+  FLAG4_BIT is not otherwise used by this malloc, but might be useful
+  in extensions. If USE_PAGE_PURGING is set, it marks binned free
+  chunks whose pages have been purged. If USE_MMAP_CACHE is set, it
+  marks mmapped chunks reusing a cached region, which is not cleared.
 */
 
 #define PINUSE_BIT          (SIZE_T_ONE)
@@ -2291,7 +3533,9 @@ typedef unsigned int flag_t;           /* The type of various bit flag sets */
  (is_mmapped(p)? MMAP_CHUNK_OVERHEAD : CHUNK_OVERHEAD)
 
 /* Return true if malloced space is not necessarily cleared */
-#if MMAP_CLEARS
+#if MMAP_CLEARS && USE_MMAP_CACHE
+#define calloc_must_clear(p) (!is_mmapped(p) || flag4inuse(p))
+#elif MMAP_CLEARS
 #define calloc_must_clear(p) (!is_mmapped(p))
 #else /* MMAP_CLEARS */
 #define calloc_must_clear(p) (1)
@@ -2459,7 +3703,11 @@ typedef struct malloc_tree_chunk* tbinptr; /* The type of bins of trees */
   * If USE_MMAP_BIT set, the segment may be merged with
     other surrounding mmapped segments and trimmed/de-allocated
     using munmap.
-  * If neither bit is set, then the segment was obtained using
+  * If RESERVED_BIT set, the segment is the committed part of the
+    address space reserved by create_mspace_reserved. It is extended
+    and trimmed by committing and decommitting the rest of the
+    reservation, and unmapped as a whole when the space is destroyed.
+  * If none of these bits is set, then the segment was obtained using
     MORECORE so can be merged with surrounding MORECORE'd segments
     and deallocated/trimmed using MORECORE with negative arguments.
 */
@@ -2469,14 +3717,30 @@ struct malloc_segment {
   size_t       size;             /* allocated size */
   struct malloc_segment* next;   /* ptr to next segment */
   flag_t       sflags;           /* mmap and extern flag */
+#if USE_INCREMENTAL_RELEASE
+  struct malloc_segment* prev;   /* ptr to previous segment */
+#endif /* USE_INCREMENTAL_RELEASE */
 };
 
 #define is_mmapped_segment(S)  ((S)->sflags & USE_MMAP_BIT)
 #define is_extern_segment(S)   ((S)->sflags & EXTERN_BIT)
+#define is_reserved_segment(S) ((S)->sflags & RESERVED_BIT)
+#define is_locked_segment(S)   ((S)->sflags & LOCKED_BIT)
 
 typedef struct malloc_segment  msegment;
 typedef struct malloc_segment* msegmentptr;
 
+#if USE_MMAP_CACHE
+/* A freed direct-mmapped region kept for reuse; base is 0 if unused */
+struct malloc_mmap_region {
+  char*        base;             /* base address */
+  size_t       size;             /* mapped size */
+  size_t       stamp;            /* mmap_clock when cached */
+};
+
+typedef struct malloc_mmap_region* mregionptr;
+#endif /* USE_MMAP_CACHE */
+
 /* ---------------------------- malloc_state ----------------------------- */
 
 /*
@@ -2492,6 +3756,10 @@ typedef struct malloc_segment* msegmentptr;
     cached from mparams in trim_check, except that it is disabled if
     an autotrim fails.
 
+  Purging
+    If USE_PAGE_PURGING is set, unpurged holds the number of bytes
+    freed into large chunks since the last purge pass.
+
   Designated victim (dv)
     This is the preferred chunk for servicing small requests that
     don't have exact fits.  It is normally the chunk split off most
@@ -2528,6 +3796,16 @@ typedef struct malloc_segment* msegmentptr;
     intended to reduce the branchiness of paths through malloc etc, as
     well as to reduce the number of memory locations read or written.
 
+  FastBins
+    If USE_FASTBINS is set, singly linked lists of recently freed small
+    chunks of the same size, indexed as smallbins, that are still
+    marked as in use so are not coalesced with their neighbors until
+    consolidated. The "fastmap" bit map records which are non-empty.
+
+  Slabs
+    If USE_SLABS is set, the heads of doubly linked lists, one per
+    slab size class, of this space's slabs that have free objects.
+
   Segments
     A list of segments headed by an embedded malloc_segment record
     representing the initial space.
@@ -2559,6 +3837,58 @@ typedef struct malloc_segment* msegmentptr;
     If USE_LOCKS is defined, the "mutex" lock is acquired and released
     around every public call using this mspace.
 
+  Remote frees
+    If USE_REMOTE_FREES is set, chunks freed into an unlocked mspace by
+    threads other than its owner are pushed onto the remote_frees list,
+    which the owner empties the next time it allocates.
+
+  Orphans
+    If USE_THREAD_MSPACES is set, the mspaces of exited threads that
+    are still in use are linked through their next_orphan fields, and
+    all thread mspaces, orphaned or not, through their next_thread
+    fields.
+
+  NUMA node
+    If USE_NUMA is set, numa_node is the node that memory obtained
+    from the system for this space is bound to, or -1 if none.
+
+  Segment index
+    If USE_SEGMENT_INDEX is set and segindex is non-null, it points to
+    nsegs pointers to the records of all segments of the space, sorted
+    by segment base, in space for segindex_max of them.
+
+  Unused segment
+    If USE_INCREMENTAL_RELEASE is set, free_seg is the record of the
+    last segment that free found to be entirely free, or 0. It may
+    have been reused since; it is checked again before being released.
+
+  Reservation
+    If USE_RESERVED_MSPACES is set, reserve_end is the end of the
+    address space reserved for a space made by create_mspace_reserved,
+    whose segment with RESERVED_BIT starts at the reservation, or 0 for
+    other spaces.
+
+  Mmap cache
+    If USE_MMAP_CACHE is set, mmap_cache holds freed direct-mmapped
+    regions, totalling mmap_cached bytes, which remain included in
+    footprint. mmap_clock counts direct mmaps and frees, for aging.
+
+  Memory pressure
+    If USE_PRESSURE_HANDLERS is set, pressure_handler and pressure_arg
+    are set by mspace_set_pressure_handler, and pressure_step is the
+    fraction of footprint_limit, in thousandths, between the marks it
+    is called at. pressure_level is the number of marks below the
+    footprint when last checked, and pressure_mark is set when it rose.
+    pressure_need is the shortfall of a request that failed at the
+    limit. Both are taken, with the lock held, by each call that may
+    raise them, which runs the handler after unlocking.
+
+  Background purging
+    If USE_BACKGROUND_PURGE is set, spaces with PURGE_BIT are linked
+    through their next_purge fields. decay_tops holds the last
+    PURGE_DECAY_STEPS samples of topsize taken by the purger, and
+    decay_step the index of the oldest.
+
   Extension support
     A void* pointer and a size_t field that can be used to help implement
     extensions to this malloc.
@@ -2574,6 +3904,23 @@ typedef struct malloc_segment* msegmentptr;
 #define MAX_SMALL_SIZE    (MIN_LARGE_SIZE - SIZE_T_ONE)
 #define MAX_SMALL_REQUEST (MAX_SMALL_SIZE - CHUNK_ALIGN_MASK - CHUNK_OVERHEAD)
 
+#if USE_SLABS
+/* Slab size classes are multiples of 8 bytes up to SLAB_MAX_SIZE */
+#define NSLABCLASSES      (SLAB_MAX_SIZE >> 3)
+struct malloc_slab;
+#endif /* USE_SLABS */
+
+#if USE_BACKGROUND_PURGE
+/* The number of samples of each space taken per decay time */
+#define PURGE_DECAY_STEPS (8U)
+#endif /* USE_BACKGROUND_PURGE */
+
+#if USE_FASTBINS
+/* Fastbins are indexed as smallbins, up to the chunk size for MAX_FAST_SIZE */
+#define MAX_FAST_CHUNK    (pad_request(MAX_FAST_SIZE))
+#define NFASTBINS         ((MAX_FAST_CHUNK >> SMALLBIN_SHIFT) + 1)
+#endif /* USE_FASTBINS */
+
 struct malloc_state {
   binmap_t   smallmap;
   binmap_t   treemap;
@@ -2584,9 +3931,19 @@ struct malloc_state {
   mchunkptr  top;
   size_t     trim_check;
   size_t     release_checks;
+#if USE_PAGE_PURGING
+  size_t     unpurged;
+#endif /* USE_PAGE_PURGING */
   size_t     magic;
   mchunkptr  smallbins[(NSMALLBINS+1)*2];
   tbinptr    treebins[NTREEBINS];
+#if USE_FASTBINS
+  binmap_t   fastmap;
+  mchunkptr  fastbins[NFASTBINS];
+#endif /* USE_FASTBINS */
+#if USE_SLABS
+  struct malloc_slab* slabs[NSLABCLASSES];
+#endif /* USE_SLABS */
   size_t     footprint;
   size_t     max_footprint;
   size_t     footprint_limit; /* zero means no limit */
@@ -2595,8 +3952,48 @@ struct malloc_state {
   MLOCK_T    mutex;     /* locate lock among fields that rarely change */
 #endif /* USE_LOCKS */
   msegment   seg;
+#if USE_SEGMENT_INDEX
+  msegmentptr* segindex;          /* zero if not built */
+  size_t     nsegs;
+  size_t     segindex_max;
+#endif /* USE_SEGMENT_INDEX */
+#if USE_INCREMENTAL_RELEASE
+  msegmentptr free_seg;           /* last segment found unused */
+#endif /* USE_INCREMENTAL_RELEASE */
   void*      extp;      /* Unused but available for extensions */
   size_t     exts;
+#if USE_REMOTE_FREES
+  THREAD_ID_T owner;                 /* meaningful if REMOTE_FREE_BIT */
+  mchunkptr volatile remote_frees;   /* pushed by other threads */
+#endif /* USE_REMOTE_FREES */
+#if USE_THREAD_MSPACES
+  struct malloc_state* next_orphan;  /* meaningful if ORPHAN_BIT */
+  struct malloc_state* next_thread;  /* in thread_spaces */
+#endif /* USE_THREAD_MSPACES */
+#if USE_NUMA
+  int        numa_node;  /* negative if not bound */
+#endif /* USE_NUMA */
+#if USE_RESERVED_MSPACES
+  char*      reserve_end;        /* zero if not reserved */
+#endif /* USE_RESERVED_MSPACES */
+#if USE_MMAP_CACHE
+  struct malloc_mmap_region mmap_cache[MMAP_CACHE_SLOTS];
+  size_t     mmap_cached;
+  size_t     mmap_clock;
+#endif /* USE_MMAP_CACHE */
+#if USE_BACKGROUND_PURGE
+  struct malloc_state* next_purge;   /* meaningful if PURGE_BIT */
+  size_t     decay_tops[PURGE_DECAY_STEPS];
+  size_t     decay_step;
+#endif /* USE_BACKGROUND_PURGE */
+#if USE_PRESSURE_HANDLERS
+  int        (*pressure_handler)(void*, size_t, void*);
+  void*      pressure_arg;
+  size_t     pressure_step;
+  size_t     pressure_level;
+  size_t     pressure_need;
+  int        pressure_mark;
+#endif /* USE_PRESSURE_HANDLERS */
 };
 
 typedef struct malloc_state*    mstate;
@@ -2617,6 +4014,20 @@ struct malloc_params {
   size_t mmap_threshold;
   size_t trim_threshold;
   flag_t default_mflags;
+#if USE_ARENAS
+  size_t narenas;
+#endif /* USE_ARENAS */
+#if USE_PAGE_PURGING
+  size_t purge_threshold;
+#endif /* USE_PAGE_PURGING */
+#if USE_BACKGROUND_PURGE
+  size_t purge_decay;
+  int    inline_trim;
+#endif /* USE_BACKGROUND_PURGE */
+#if USE_ADAPTIVE_MMAP_THRESHOLD
+  size_t max_mmap_threshold; /* zero if adaptation is off */
+  size_t mmap_threshold_changes;
+#endif /* USE_ADAPTIVE_MMAP_THRESHOLD */
 };
 
 static struct malloc_params mparams;
@@ -2624,6 +4035,13 @@ static struct malloc_params mparams;
 /* Ensure mparams initialized */
 #define ensure_initialization() (void)(mparams.magic != 0 || init_mparams())
 
+/* True if free may trim, release segments and purge (see M_INLINE_TRIM) */
+#if USE_BACKGROUND_PURGE
+#define inline_trim()      (mparams.inline_trim)
+#else /* USE_BACKGROUND_PURGE */
+#define inline_trim()      (1)
+#endif /* USE_BACKGROUND_PURGE */
+
 #if !ONLY_MSPACES
 
 /* The global malloc_state used for all non-"mspace" calls */
@@ -2631,8 +4049,101 @@ static struct malloc_state _gm_;
 #define gm                 (&_gm_)
 #define is_global(M)       ((M) == &_gm_)
 
+#if USE_THREAD_CACHE
+/*
+  Per-thread caches of small chunks for gm (see USE_THREAD_CACHE).
+  Cached chunks stay marked as in use, and are linked through their fd
+  fields in one list per smallbin index. The state is 0 until the
+  thread registers its exit handler, 1 while the cache is in use, and
+  -1 if registration failed or the exit handler has already run, in
+  which case the cache is bypassed.
+*/
+struct thread_cache {
+  mchunkptr bins[NSMALLBINS];
+  unsigned  counts[NSMALLBINS];
+  int       state;
+};
+
+static THREAD_LOCAL struct thread_cache tcache;
+static pthread_key_t tcache_key;
+static int tcache_key_ok;
+static void tcache_thread_exit(void* tc);
+#endif /* USE_THREAD_CACHE */
+
+#if USE_PERCPU_CACHE
+/*
+  Per-processor caches of small chunks for gm (see USE_PERCPU_CACHE),
+  laid out like thread caches, but each guarded by a try-only lock.
+  They are spaced CPU_CACHE_STRIDE bytes apart so that no two share a
+  cache line. ncpu_caches stays zero until the caches are allocated.
+*/
+struct cpu_cache {
+  mchunkptr bins[NSMALLBINS];
+  unsigned  counts[NSMALLBINS];
+  volatile int lock;
+};
+
+#define CPU_CACHE_STRIDE   ((sizeof(struct cpu_cache) + 63U) & ~(size_t)63U)
+#define cpu_cache_at(i)\
+  ((struct cpu_cache*)(cpu_caches + (i) * CPU_CACHE_STRIDE))
+
+static char* cpu_caches;
+static size_t ncpu_caches;
+#endif /* USE_PERCPU_CACHE */
+
+#if USE_ARENAS
+/*
+  Arenas (see USE_ARENAS). arenas[0] is gm, and the others are locked
+  mspaces created on demand. Each thread records one plus the index
+  of the arena it last used, or 0 if it has not yet been assigned one.
+  thread_mstate() is the state used for memalign and other routines
+  that allocate on behalf of a thread outside of malloc itself.
+*/
+static mstate arenas[MAX_ARENAS] = { &_gm_ };
+#if USE_NUMA
+static size_t numa_node_count(void);
+#else /* USE_NUMA */
+static size_t arena_next;
+#endif /* USE_NUMA */
+static THREAD_LOCAL size_t thread_arena;
+static void* arena_malloc(size_t bytes);
+static mstate home_arena(void);
+#define thread_mstate()    home_arena()
+#else /* USE_ARENAS */
+#define thread_mstate()    gm
+#endif /* USE_ARENAS */
+
 #endif /* !ONLY_MSPACES */
 
+#if USE_THREAD_MSPACES
+/*
+  Thread mspaces (see USE_THREAD_MSPACES). thread_ms is the calling
+  thread's mspace, or 0 if it has none. The key's destructor orphans
+  it on thread exit. orphans is guarded by the global lock.
+  thread_spaces lists all thread mspaces until they are destroyed, so
+  that they can be locked across fork. It is guarded by
+  thread_ms_mutex, which is acquired before any space's lock.
+*/
+static THREAD_LOCAL mstate thread_ms;
+static mstate orphans;
+static mstate thread_spaces;
+static MLOCK_T thread_ms_mutex;
+static pthread_key_t thread_ms_key;
+static int thread_ms_key_ok;
+static void thread_mspace_exit(void* ms);
+#endif /* USE_THREAD_MSPACES */
+
+#if USE_BACKGROUND_PURGE
+/*
+  The spaces handled by the background purger, linked through their
+  next_purge fields. purge_mutex, initialized in init_mparams, guards
+  the list and purge_running, and is acquired before any space's lock.
+*/
+static MLOCK_T purge_mutex;
+static mstate purge_list;
+static int purge_running;
+#endif /* USE_BACKGROUND_PURGE */
+
 #define is_initialized(M)  ((M)->top != 0)
 
 /* -------------------------- system alloc setup ------------------------- */
@@ -2692,9 +4203,106 @@ static struct malloc_state _gm_;
 #define segment_holds(S, A)\
   ((char*)(A) >= S->base && (char*)(A) < S->base + S->size)
 
+#if USE_SEGMENT_INDEX
+/*
+  The segment index is kept sorted by base. Segments never overlap, and
+  a segment's base only moves down when a new region just below it is
+  prepended, so updating bases and sizes in place preserves the order.
+  Records are only added and removed by add_segment and
+  release_unused_segments, which update the index to match.
+*/
+
+/* Return the number of indexed segments with base at or below addr */
+static size_t segindex_search(mstate m, char* addr) {
+  size_t lo = 0;
+  size_t hi = m->nsegs;
+  while (lo < hi) {
+    size_t mid = (lo + hi) >> 1;
+    if (m->segindex[mid]->base <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Unmap the index, so that lookups walk the segment list */
+static void segindex_free(mstate m) {
+  if (m->segindex != 0) {
+    (void)CALL_MUNMAP(m->segindex, m->segindex_max * sizeof(msegmentptr));
+    m->segindex = 0;
+    m->nsegs = m->segindex_max = 0;
+  }
+}
+
+/* Add a record to the index, dropping the index if it cannot grow */
+static void segindex_insert(mstate m, msegmentptr ss) {
+  size_t i;
+  if (m->segindex == 0)
+    return;
+  if (m->nsegs == m->segindex_max) {
+    size_t nmax = m->segindex_max << 1;
+    msegmentptr* ns = (msegmentptr*)CALL_MMAP(nmax * sizeof(msegmentptr));
+    if (ns == (msegmentptr*)MFAIL) {
+      segindex_free(m);
+      return;
+    }
+    memcpy(ns, m->segindex, m->nsegs * sizeof(msegmentptr));
+    (void)CALL_MUNMAP(m->segindex, m->segindex_max * sizeof(msegmentptr));
+    m->segindex = ns;
+    m->segindex_max = nmax;
+  }
+  i = segindex_search(m, ss->base);
+  memmove(&m->segindex[i + 1], &m->segindex[i],
+          (m->nsegs - i) * sizeof(msegmentptr));
+  m->segindex[i] = ss;
+  ++m->nsegs;
+}
+
+/* Remove a record from the index; its base must still be readable */
+static void segindex_remove(mstate m, msegmentptr ss) {
+  if (m->segindex != 0) {
+    size_t i = segindex_search(m, ss->base) - 1;
+    assert(m->segindex[i] == ss);
+    --m->nsegs;
+    memmove(&m->segindex[i], &m->segindex[i + 1],
+            (m->nsegs - i) * sizeof(msegmentptr));
+  }
+}
+
+/* Build the index from the segment list */
+static void segindex_build(mstate m) {
+  size_t smax = mparams.page_size / sizeof(msegmentptr);
+  msegmentptr sp;
+  size_t n = 0;
+  for (sp = &m->seg; sp != 0; sp = sp->next)
+    ++n;
+  while (smax < n)
+    smax <<= 1;
+  m->segindex = (msegmentptr*)CALL_MMAP(smax * sizeof(msegmentptr));
+  if (m->segindex == (msegmentptr*)MFAIL)
+    m->segindex = 0;
+  else {
+    m->nsegs = 0;
+    m->segindex_max = smax;
+    for (sp = &m->seg; sp != 0; sp = sp->next)
+      segindex_insert(m, sp);
+  }
+}
+#endif /* USE_SEGMENT_INDEX */
+
 /* Return segment holding given address */
 static msegmentptr segment_holding(mstate m, char* addr) {
   msegmentptr sp = &m->seg;
+#if USE_SEGMENT_INDEX
+  if (m->segindex != 0) {
+    size_t i = segindex_search(m, addr);
+    if (i == 0)
+      return 0;
+    sp = m->segindex[i - 1];
+    return (addr < sp->base + sp->size)? sp : 0;
+  }
+#endif /* USE_SEGMENT_INDEX */
   for (;;) {
     if (addr >= sp->base && addr < sp->base + sp->size)
       return sp;
@@ -2706,6 +4314,14 @@ static msegmentptr segment_holding(mstate m, char* addr) {
 /* Return true if segment contains a segment link */
 static int has_segment_link(mstate m, msegmentptr ss) {
   msegmentptr sp = &m->seg;
+#if USE_SEGMENT_INDEX
+  /*
+    Every record other than m->seg is kept at the tail of its own
+    segment, so only the segment described by m->seg can lack one.
+  */
+  if (m->segindex != 0)
+    return ss != sp || segment_holds(ss, sp);
+#endif /* USE_SEGMENT_INDEX */
   for (;;) {
     if ((char*)sp >= ss->base && (char*)sp < ss->base + ss->size)
       return 1;
@@ -2715,11 +4331,14 @@ static int has_segment_link(mstate m, msegmentptr ss) {
 }
 
 #ifndef MORECORE_CANNOT_TRIM
-#define should_trim(M,s)  ((s) > (M)->trim_check)
+#define should_trim(M,s)  ((s) > (M)->trim_check && inline_trim())
 #else  /* MORECORE_CANNOT_TRIM */
 #define should_trim(M,s)  (0)
 #endif /* MORECORE_CANNOT_TRIM */
 
+/* True if it is time for free to release unused segments */
+#define should_release(M) (inline_trim() && --(M)->release_checks == 0)
+
 /*
   TOP_FOOT_SIZE is padding at the end of a segment, including space
   that may be needed to place segment records and fenceposts when new
@@ -2921,6 +4540,13 @@ static size_t traverse_and_check(mstate m);
 #define clear_treemap(M,i)      ((M)->treemap  &= ~idx2bit(i))
 #define treemap_is_marked(M,i)  ((M)->treemap  &   idx2bit(i))
 
+#if USE_FASTBINS
+#define mark_fastmap(M,i)       ((M)->fastmap  |=  idx2bit(i))
+#define clear_fastmap(M,i)      ((M)->fastmap  &= ~idx2bit(i))
+#define fastmap_is_marked(M,i)  ((M)->fastmap  &   idx2bit(i))
+static void consolidate_fast_chunks(mstate m);
+#endif /* USE_FASTBINS */
+
 /* isolate the least set bit of a bitmap */
 #define least_bit(x)         ((x) & -(x))
 
@@ -3021,7 +4647,15 @@ static size_t traverse_and_check(mstate m);
 
 #if (FOOTERS && !INSECURE)
 /* Check if (alleged) mstate m has expected magic field */
+#if USE_SHARED_MSPACES
+/* A shared space's magic is public, so also check that M is one */
+#define ok_magic(M)\
+  ((M)->magic == mparams.magic ||\
+   ((M)->magic == SHARED_MSPACE_MAGIC && ((M)->mflags & SHARED_BIT) &&\
+    (M) == (mstate)chunk2mem(align_as_chunk((M)->seg.base))))
+#else /* USE_SHARED_MSPACES */
 #define ok_magic(M)      ((M)->magic == mparams.magic)
+#endif /* USE_SHARED_MSPACES */
 #else  /* (FOOTERS && !INSECURE) */
 #define ok_magic(M)      (1)
 #endif /* (FOOTERS && !INSECURE) */
@@ -3061,6 +4695,20 @@ static size_t traverse_and_check(mstate m);
 
 #else /* FOOTERS */
 
+#if USE_SHARED_MSPACES
+/*
+  Footers of chunks in shared spaces are made with their fixed magic
+  instead, told apart by its bit 2, which is clear in mparams.magic.
+*/
+#define mark_inuse_foot(M,p,s)\
+  (((mchunkptr)((char*)(p) + (s)))->prev_foot = ((size_t)(M) ^ (M)->magic))
+
+#define foot_mstate(f)\
+  ((mstate)((f) ^ (((f) & (size_t)4U)? SHARED_MSPACE_MAGIC : mparams.magic)))
+
+#define get_mstate_for(p)\
+  foot_mstate(((mchunkptr)((char*)(p) + (chunksize(p))))->prev_foot)
+#else /* USE_SHARED_MSPACES */
 /* Set foot of inuse chunk to be xor of mstate and seed */
 #define mark_inuse_foot(M,p,s)\
   (((mchunkptr)((char*)(p) + (s)))->prev_foot = ((size_t)(M) ^ mparams.magic))
@@ -3068,6 +4716,7 @@ static size_t traverse_and_check(mstate m);
 #define get_mstate_for(p)\
   ((mstate)(((mchunkptr)((char*)(p) +\
     (chunksize(p))))->prev_foot ^ mparams.magic))
+#endif /* USE_SHARED_MSPACES */
 
 #define set_inuse(M,p,s)\
   ((p)->head = (((p)->head & PINUSE_BIT)|s|CINUSE_BIT),\
@@ -3088,27 +4737,144 @@ static size_t traverse_and_check(mstate m);
 /* ---------------------------- setting mparams -------------------------- */
 
 #if LOCK_AT_FORK
-static void pre_fork(void)         { ACQUIRE_LOCK(&(gm)->mutex); }
-static void post_fork_parent(void) { RELEASE_LOCK(&(gm)->mutex); }
-static void post_fork_child(void)  { INITIAL_LOCK(&(gm)->mutex); }
-#endif /* LOCK_AT_FORK */
+#if !ONLY_MSPACES && USE_ARENAS
+/*
+  The arenas locked by pre_fork, which are exactly the ones released
+  after fork. arena_at may publish another one until the global lock
+  is held, so pre_fork locks those found missing and checks again.
+*/
+static mstate fork_arenas[MAX_ARENAS];
+
+static void lock_fork_arenas(void) {
+  size_t i;
+  for (i = 1; i < MAX_ARENAS; ++i) {
+    mstate m = arenas[i];
+    if (m != 0 && fork_arenas[i] == 0) {
+      ACQUIRE_LOCK(&m->mutex);
+      fork_arenas[i] = m;
+    }
+  }
+}
 
-/* Initialize mparams */
-static int init_mparams(void) {
-#ifdef NEED_GLOBAL_LOCK_INIT
-  if (malloc_global_mutex_status <= 0)
-    init_malloc_global_mutex();
-#endif
+static int missing_fork_arenas(void) {
+  size_t i;
+  for (i = 1; i < MAX_ARENAS; ++i)
+    if (arenas[i] != 0 && fork_arenas[i] == 0)
+      return 1;
+  return 0;
+}
+#endif /* !ONLY_MSPACES && USE_ARENAS */
 
+/*
+  Hold every malloc lock across fork, in lock order: the purger and
+  thread mspace list locks, then the spaces, then the global lock.
+*/
+static void pre_fork(void) {
+#if USE_THREAD_MSPACES
+  mstate m;
+#endif /* USE_THREAD_MSPACES */
+#if USE_BACKGROUND_PURGE
+  ACQUIRE_LOCK(&purge_mutex);
+#endif /* USE_BACKGROUND_PURGE */
+#if USE_THREAD_MSPACES
+  ACQUIRE_LOCK(&thread_ms_mutex);
+  for (m = thread_spaces; m != 0; m = m->next_thread)
+    ACQUIRE_LOCK(&m->mutex);
+#endif /* USE_THREAD_MSPACES */
+#if !ONLY_MSPACES
+  ACQUIRE_LOCK(&(gm)->mutex);
+#if USE_ARENAS
+  lock_fork_arenas();
+#endif /* USE_ARENAS */
+#endif /* !ONLY_MSPACES */
   ACQUIRE_MALLOC_GLOBAL_LOCK();
-  if (mparams.magic == 0) {
-    size_t magic;
-    size_t psize;
+#if !ONLY_MSPACES && USE_ARENAS
+  while (missing_fork_arenas()) { /* published before the global lock */
+    RELEASE_MALLOC_GLOBAL_LOCK();
+    lock_fork_arenas();
+    ACQUIRE_MALLOC_GLOBAL_LOCK();
+  }
+#endif /* !ONLY_MSPACES && USE_ARENAS */
+}
+
+static void post_fork_parent(void) {
+#if USE_ARENAS
+  size_t i;
+#endif /* USE_ARENAS */
+#if USE_THREAD_MSPACES
+  mstate m;
+#endif /* USE_THREAD_MSPACES */
+  RELEASE_MALLOC_GLOBAL_LOCK();
+#if !ONLY_MSPACES
+#if USE_ARENAS
+  for (i = 1; i < MAX_ARENAS; ++i) {
+    if (fork_arenas[i] != 0) {
+      RELEASE_LOCK(&fork_arenas[i]->mutex);
+      fork_arenas[i] = 0;
+    }
+  }
+#endif /* USE_ARENAS */
+  RELEASE_LOCK(&(gm)->mutex);
+#endif /* !ONLY_MSPACES */
+#if USE_THREAD_MSPACES
+  for (m = thread_spaces; m != 0; m = m->next_thread)
+    RELEASE_LOCK(&m->mutex);
+  RELEASE_LOCK(&thread_ms_mutex);
+#endif /* USE_THREAD_MSPACES */
+#if USE_BACKGROUND_PURGE
+  RELEASE_LOCK(&purge_mutex);
+#endif /* USE_BACKGROUND_PURGE */
+}
+
+static void post_fork_child(void) {
+#if USE_ARENAS
+  size_t i;
+#endif /* USE_ARENAS */
+#if USE_THREAD_MSPACES
+  mstate m;
+#endif /* USE_THREAD_MSPACES */
+  INITIAL_LOCK(&malloc_global_mutex);
+#if !ONLY_MSPACES
+#if USE_ARENAS
+  for (i = 1; i < MAX_ARENAS; ++i) {
+    if (fork_arenas[i] != 0) {
+      INITIAL_LOCK(&fork_arenas[i]->mutex);
+      fork_arenas[i] = 0;
+    }
+  }
+#endif /* USE_ARENAS */
+  INITIAL_LOCK(&(gm)->mutex);
+#endif /* !ONLY_MSPACES */
+#if USE_THREAD_MSPACES
+  for (m = thread_spaces; m != 0; m = m->next_thread)
+    INITIAL_LOCK(&m->mutex);
+  INITIAL_LOCK(&thread_ms_mutex);
+#endif /* USE_THREAD_MSPACES */
+#if USE_BACKGROUND_PURGE
+  INITIAL_LOCK(&purge_mutex);
+  purge_running = 0; /* the purger thread is not forked */
+#endif /* USE_BACKGROUND_PURGE */
+}
+#endif /* LOCK_AT_FORK */
+
+/* Initialize mparams */
+static int init_mparams(void) {
+#ifdef NEED_GLOBAL_LOCK_INIT
+  if (malloc_global_mutex_status <= 0)
+    init_malloc_global_mutex();
+#endif
+
+  ACQUIRE_MALLOC_GLOBAL_LOCK();
+  if (mparams.magic == 0) {
+    size_t magic;
+    size_t psize;
     size_t gsize;
 
 #ifndef WIN32
     psize = malloc_getpagesize;
     gsize = ((DEFAULT_GRANULARITY != 0)? DEFAULT_GRANULARITY : psize);
+    if (gsize < MIN_GRANULARITY)
+      gsize = MIN_GRANULARITY;
 #else /* WIN32 */
     {
       SYSTEM_INFO system_info;
@@ -3137,8 +4903,18 @@ static int init_mparams(void) {
     mparams.granularity = gsize;
     mparams.page_size = psize;
     mparams.mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+#if USE_PAGE_PURGING
+    mparams.purge_threshold = DEFAULT_PURGE_THRESHOLD;
+#endif /* USE_PAGE_PURGING */
+#if USE_BACKGROUND_PURGE
+    mparams.purge_decay = DEFAULT_PURGE_DECAY;
+    mparams.inline_trim = 1;
+#endif /* USE_BACKGROUND_PURGE */
+#if USE_ADAPTIVE_MMAP_THRESHOLD
+    mparams.max_mmap_threshold = DEFAULT_MMAP_THRESHOLD_MAX;
+#endif /* USE_ADAPTIVE_MMAP_THRESHOLD */
     mparams.trim_threshold = DEFAULT_TRIM_THRESHOLD;
-#if MORECORE_CONTIGUOUS
+#if MORECORE_CONTIGUOUS && !USE_HUGE_PAGES
     mparams.default_mflags = USE_LOCK_BIT|USE_MMAP_BIT;
 #else  /* MORECORE_CONTIGUOUS */
     mparams.default_mflags = USE_LOCK_BIT|USE_MMAP_BIT|USE_NONCONTIGUOUS_BIT;
@@ -3148,7 +4924,58 @@ static int init_mparams(void) {
     /* Set up lock for main malloc area */
     gm->mflags = mparams.default_mflags;
     (void)INITIAL_LOCK(&gm->mutex);
+#if USE_NUMA
+    gm->numa_node = (USE_ARENAS)? 0 : -1;
+#endif /* USE_NUMA */
+#if USE_THREAD_CACHE
+    tcache_key_ok = (pthread_key_create(&tcache_key, tcache_thread_exit) == 0);
+#endif /* USE_THREAD_CACHE */
+#if USE_PERCPU_CACHE
+    {
+      long n = sysconf(_SC_NPROCESSORS_CONF);
+      if (n > 0) {
+        size_t csize = page_align((size_t)n * CPU_CACHE_STRIDE);
+        char* mem = (char*)(CALL_MMAP(csize));
+        if (mem != CMFAIL) {
+          cpu_caches = mem;
+          ncpu_caches = (size_t)n;
+        }
+      }
+    }
+#endif /* USE_PERCPU_CACHE */
+#if USE_ARENAS
+    {
+      size_t n = DEFAULT_ARENAS;
+#if USE_NUMA
+      if (n == 0)
+        n = numa_node_count();
+#endif /* USE_NUMA */
+      if (n == 0) {
+#ifdef WIN32
+        SYSTEM_INFO system_info;
+        GetSystemInfo(&system_info);
+        n = system_info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = (ncpus > 0)? (size_t)ncpus : 1;
+#else /* WIN32 */
+        n = 1;
+#endif /* WIN32 */
+      }
+      mparams.narenas = (n < MAX_ARENAS)? n : MAX_ARENAS;
+    }
+#endif /* USE_ARENAS */
 #endif
+#if USE_THREAD_MSPACES
+    thread_ms_key_ok =
+      (pthread_key_create(&thread_ms_key, thread_mspace_exit) == 0);
+#endif /* USE_THREAD_MSPACES */
+#if USE_BACKGROUND_PURGE
+    (void)INITIAL_LOCK(&purge_mutex);
+#endif /* USE_BACKGROUND_PURGE */
+#if USE_THREAD_MSPACES
+    (void)INITIAL_LOCK(&thread_ms_mutex);
+#endif /* USE_THREAD_MSPACES */
 #if LOCK_AT_FORK
     pthread_atfork(&pre_fork, &post_fork_parent, &post_fork_child);
 #endif
@@ -3174,6 +5001,9 @@ static int init_mparams(void) {
 #endif
       magic |= (size_t)8U;    /* ensure nonzero */
       magic &= ~(size_t)7U;   /* improve chances of fault for bad values */
+#if USE_ARENAS
+      gm->magic = magic; /* gm is also used via mspace routines */
+#endif /* USE_ARENAS */
       /* Until memory modes commonly available, use volatile-write */
       (*(volatile size_t *)(&(mparams.magic))) = magic;
     }
@@ -3190,18 +5020,60 @@ static int change_mparam(int param_number, int value) {
   val = (value == -1)? MAX_SIZE_T : (size_t)value;
   switch(param_number) {
   case M_TRIM_THRESHOLD:
+#if USE_ADAPTIVE_MMAP_THRESHOLD
+    mparams.max_mmap_threshold = 0;
+#endif /* USE_ADAPTIVE_MMAP_THRESHOLD */
     mparams.trim_threshold = val;
     return 1;
   case M_GRANULARITY:
-    if (val >= mparams.page_size && ((val & (val-1)) == 0)) {
+    if (val >= mparams.page_size && val >= MIN_GRANULARITY &&
+        ((val & (val-1)) == 0)) {
       mparams.granularity = val;
       return 1;
     }
     else
       return 0;
   case M_MMAP_THRESHOLD:
+#if USE_ADAPTIVE_MMAP_THRESHOLD
+    mparams.max_mmap_threshold = 0;
+#endif /* USE_ADAPTIVE_MMAP_THRESHOLD */
     mparams.mmap_threshold = val;
     return 1;
+#if USE_ARENAS
+  case M_ARENAS:
+    if (val >= 1 && val <= MAX_ARENAS) {
+      mparams.narenas = val;
+      return 1;
+    }
+    else
+      return 0;
+#endif /* USE_ARENAS */
+#if USE_PAGE_PURGING
+  case M_PURGE_THRESHOLD:
+    mparams.purge_threshold = val;
+    return 1;
+#endif /* USE_PAGE_PURGING */
+#if USE_ADAPTIVE_MMAP_THRESHOLD
+  case M_MMAP_THRESHOLD_MAX:
+    mparams.max_mmap_threshold = val;
+    return 1;
+#endif /* USE_ADAPTIVE_MMAP_THRESHOLD */
+#if USE_BACKGROUND_PURGE
+  case M_PURGE_DECAY:
+    if (val != 0) {
+      mparams.purge_decay = val;
+      return 1;
+    }
+    else
+      return 0;
+  case M_INLINE_TRIM:
+    if (value == 0 || value == 1) {
+      mparams.inline_trim = value;
+      return 1;
+    }
+    else
+      return 0;
+#endif /* USE_BACKGROUND_PURGE */
   default:
     return 0;
   }
@@ -3483,11 +5355,17 @@ static struct mallinfo internal_mallinfo(mstate m) {
   struct mallinfo nm = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
   ensure_initialization();
   if (!PREACTION(m)) {
+#if USE_FASTBINS
+    consolidate_fast_chunks(m);
+#endif /* USE_FASTBINS */
     check_malloc_state(m);
     if (is_initialized(m)) {
       size_t nfree = SIZE_T_ONE; /* top always free */
       size_t mfree = m->topsize + TOP_FOOT_SIZE;
       size_t sum = mfree;
+#if USE_MMAP_CACHE
+      mfree += m->mmap_cached;
+#endif /* USE_MMAP_CACHE */
       msegmentptr s = &m->seg;
       while (s != 0) {
         mchunkptr q = align_as_chunk(s->base);
@@ -3526,12 +5404,18 @@ static void internal_malloc_stats(mstate m) {
     size_t maxfp = 0;
     size_t fp = 0;
     size_t used = 0;
+#if USE_FASTBINS
+    consolidate_fast_chunks(m);
+#endif /* USE_FASTBINS */
     check_malloc_state(m);
     if (is_initialized(m)) {
       msegmentptr s = &m->seg;
       maxfp = m->max_footprint;
       fp = m->footprint;
       used = fp - (m->topsize + TOP_FOOT_SIZE);
+#if USE_MMAP_CACHE
+      used -= m->mmap_cached;
+#endif /* USE_MMAP_CACHE */
 
       while (s != 0) {
         mchunkptr q = align_as_chunk(s->base);
@@ -3548,6 +5432,12 @@ static void internal_malloc_stats(mstate m) {
     fprintf(stderr, "max system bytes = %10lu\n", (unsigned long)(maxfp));
     fprintf(stderr, "system bytes     = %10lu\n", (unsigned long)(fp));
     fprintf(stderr, "in use bytes     = %10lu\n", (unsigned long)(used));
+#if USE_ADAPTIVE_MMAP_THRESHOLD
+    fprintf(stderr, "mmap threshold   = %10lu\n",
+            (unsigned long)(mparams.mmap_threshold));
+    fprintf(stderr, "mmap adjustments = %10lu\n",
+            (unsigned long)(mparams.mmap_threshold_changes));
+#endif /* USE_ADAPTIVE_MMAP_THRESHOLD */
   }
 }
 #endif /* NO_MALLOC_STATS */
@@ -3790,9 +5680,13 @@ static void internal_malloc_stats(mstate m) {
   else { tchunkptr TP = (tchunkptr)(P); unlink_large_chunk(M, TP); }
 
 
-/* Relays to internal calls to malloc/free from realloc, memalign etc */
+/*
+  Relays to internal calls to malloc/free from realloc, memalign etc.
+  With arenas, these must not go through malloc itself, which might
+  choose a different arena than m.
+*/
 
-#if ONLY_MSPACES
+#if ONLY_MSPACES || USE_ARENAS
 #define internal_malloc(m, b) mspace_malloc(m, b)
 #define internal_free(m, mem) mspace_free(m,mem);
 #else /* ONLY_MSPACES */
@@ -3807,6 +5701,292 @@ static void internal_malloc_stats(mstate m) {
 #endif /* MSPACES */
 #endif /* ONLY_MSPACES */
 
+#if USE_NUMA
+
+/* ------------------------------ NUMA support --------------------------- */
+
+/* Nodes are passed to mbind as a mask in one unsigned long */
+#define MAX_NUMA_NODES      (sizeof(unsigned long) * 8)
+
+/* Bind the whole pages of fresh memory at base to node, if any */
+static void numa_bind(char* base, size_t size, int node) {
+  if (node >= 0 && (size_t)node < MAX_NUMA_NODES) {
+    size_t mask = mparams.page_size - SIZE_T_ONE;
+    char* start = (char*)(((size_t)base + mask) & ~mask);
+    char* end = (char*)(((size_t)base + size) & ~mask);
+    if (start < end) {
+      unsigned long nodes = 1UL << node;
+      (void)syscall(SYS_mbind, start, (size_t)(end - start), NUMA_POLICY,
+                    &nodes, (unsigned long)MAX_NUMA_NODES + 1, 0U);
+    }
+  }
+}
+
+#if USE_ARENAS
+/* The node the calling thread is running on, or 0 if unknown */
+static int numa_current_node(void) {
+  unsigned int cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, (void*)0) == 0)
+    return (int)node;
+  return 0;
+}
+
+/* The number of possible nodes, from sysfs, or 1 if unknown */
+static size_t numa_node_count(void) {
+  size_t n = 0;
+  char buf[64];
+  int fd = open("/sys/devices/system/node/possible", O_RDONLY);
+  if (fd >= 0) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    ssize_t i;
+    size_t last = 0;
+    for (i = 0; i < len; ++i) { /* the last number is the highest node */
+      if (buf[i] >= '0' && buf[i] <= '9')
+        last = last * 10 + (size_t)(buf[i] - '0');
+      else if (buf[i] == '-' || buf[i] == ',') {
+        n = last + 1;
+        last = 0;
+      }
+      else
+        break;
+    }
+    if (i > 0 && buf[i-1] >= '0' && buf[i-1] <= '9')
+      n = last + 1;
+    close(fd);
+  }
+  return (n != 0)? n : 1;
+}
+#endif /* USE_ARENAS */
+
+#endif /* USE_NUMA */
+
+#if USE_PREFAULT_MSPACES
+
+/* ---------------------------- Prefaulting ------------------------------ */
+
+#define prefaults(M)        ((M)->mflags & (PREFAULT_BIT | MLOCK_BIT))
+
+/* Fault in the whole pages of memory at base, writable */
+static void populate_pages(char* base, size_t size) {
+  size_t mask = mparams.page_size - SIZE_T_ONE;
+  char* start = (char*)(((size_t)base + mask) & ~mask);
+  char* end = (char*)(((size_t)base + size) & ~mask);
+  if (start < end) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, (size_t)(end - start), MADV_POPULATE_WRITE) == 0)
+      return;
+#endif /* MADV_POPULATE_WRITE */
+    for (; start < end; start += mparams.page_size)
+      *(volatile char*)start = *(volatile char*)start;
+  }
+}
+
+/*
+  Populate or lock fresh memory at base as the flags of m ask, and
+  return LOCKED_BIT if it was locked. Locking also faults it in.
+*/
+static flag_t prefault_memory(mstate m, char* base, size_t size) {
+  if ((m->mflags & MLOCK_BIT) && mlock(base, size) == 0)
+    return LOCKED_BIT;
+  if (prefaults(m))
+    populate_pages(base, size);
+  return 0;
+}
+
+/*
+  Keep segment sp, just merged with fresh memory at base locked as
+  locked says, marked locked only if both parts are.
+*/
+static void merge_locked(msegmentptr sp, char* base, size_t size,
+                         flag_t locked) {
+  if ((sp->sflags & LOCKED_BIT) != locked) {
+    if (locked != 0)
+      (void)munlock(base, size);
+    else
+      (void)munlock(sp->base, sp->size);
+    sp->sflags &= ~LOCKED_BIT;
+  }
+}
+
+#else /* USE_PREFAULT_MSPACES */
+#define prefaults(M)        (0)
+#endif /* USE_PREFAULT_MSPACES */
+
+#if USE_PRESSURE_HANDLERS
+
+/* -------------------------- Memory pressure ---------------------------- */
+
+/* Note the shortfall of a request refused because fp exceeds the limit */
+#define note_pressure_need(M, fp)\
+  if ((fp) > (M)->footprint_limit && (fp) > (M)->footprint)\
+    (M)->pressure_need = (fp) - (M)->footprint_limit
+
+/* Note whether the footprint of m has grown past another mark */
+static void note_pressure_level(mstate m) {
+  if (m->pressure_handler != 0 && m->footprint_limit != 0) {
+    size_t step = m->footprint_limit / 1000U * m->pressure_step;
+    size_t level = (step == 0)? 0 : m->footprint / step;
+    if (level > m->pressure_level)
+      m->pressure_mark = 1;
+    m->pressure_level = level;
+  }
+}
+
+static void* mspace_malloc_locked(mstate ms, size_t bytes);
+
+/* Register the pressure handler of m, with m locked */
+static void set_pressure_handler(mstate m,
+                                 int (*handler)(void*, size_t, void*),
+                                 void* arg, size_t permille) {
+  m->pressure_handler = handler;
+  m->pressure_arg = arg;
+  m->pressure_step = permille;
+  m->pressure_level = 0;
+  m->pressure_mark = 0;
+  note_pressure_level(m);
+  m->pressure_mark = 0; /* only report marks reached from now on */
+}
+
+/*
+  Take the pressure events of m, with m locked, after a request that
+  failed if failed is nonzero, returning whether the handler should
+  run, and the shortfall of a failed request in *need. Every call that
+  may raise events takes them, so none are left for a later request.
+*/
+static int take_pressure(mstate m, int failed, size_t* need) {
+  int run = 0;
+  *need = 0;
+  if (m->pressure_handler != 0) {
+    if (failed)
+      *need = m->pressure_need;
+    run = m->pressure_mark || *need != 0;
+  }
+  m->pressure_need = 0;
+  m->pressure_mark = 0;
+  return run;
+}
+
+/* Run the pressure handler of m, unlocked; nonzero if it released memory */
+static int run_pressure_handler(mstate m, size_t need) {
+  int (*handler)(void*, size_t, void*) = m->pressure_handler;
+  return handler != 0 && handler((void*)m, need, m->pressure_arg) != 0;
+}
+
+/*
+  Run the pressure handler of m, unlocked, for a request for bytes
+  that returned mem, retrying the request once if it failed short of
+  need bytes and the handler released memory.
+*/
+static void* relieve_pressure(mstate m, void* mem, size_t bytes,
+                              size_t need) {
+  if (run_pressure_handler(m, need) && mem == 0 && need != 0 &&
+      !PREACTION(m)) {
+    mem = mspace_malloc_locked(m, bytes);
+    m->pressure_need = 0;
+    m->pressure_mark = 0;
+    POSTACTION(m);
+  }
+  return mem;
+}
+
+#endif /* USE_PRESSURE_HANDLERS */
+
+#if USE_RESIDENT_BYTES
+
+/* ------------------------- Resident accounting ------------------------- */
+
+/* Segments copied per hold of the lock, and pages per call to mincore */
+#define RESIDENT_SEGMENTS   (16U)
+#define RESIDENT_PAGES      (256U)
+
+/* The number of resident bytes in the pages holding size bytes at base */
+static size_t resident_pages(char* base, size_t size) {
+  size_t resident = 0;
+  size_t psize = mparams.page_size;
+  char* start = (char*)((size_t)base & ~(psize - SIZE_T_ONE));
+  char* end = (char*)page_align((size_t)base + size);
+  unsigned char vec[RESIDENT_PAGES];
+  while (start < end) {
+    size_t n = (size_t)(end - start) / psize;
+    if (n > RESIDENT_PAGES)
+      n = RESIDENT_PAGES;
+    if (mincore(start, n * psize, vec) == 0) { /* fails if since unmapped */
+      size_t i;
+      for (i = 0; i != n; ++i)
+        if (vec[i] & 1)
+          resident += psize;
+    }
+    start += n * psize;
+  }
+  return resident;
+}
+
+/*
+  Copy out the bases and sizes of the (up to RESIDENT_SEGMENTS)
+  segments of m lowest in memory at or above next, in address order,
+  returning how many there were. Called with m locked.
+*/
+static size_t next_segments(mstate m, char* next, char** bases,
+                            size_t* sizes) {
+  size_t n = 0, i;
+  msegmentptr sp;
+#if USE_SEGMENT_INDEX
+  if (m->segindex != 0) {
+    i = (next == 0)? 0 : segindex_search(m, next - 1);
+    for (; i < m->nsegs && n != RESIDENT_SEGMENTS; ++i, ++n) {
+      bases[n] = m->segindex[i]->base;
+      sizes[n] = m->segindex[i]->size;
+    }
+    return n;
+  }
+#endif /* USE_SEGMENT_INDEX */
+  for (sp = &m->seg; sp != 0; sp = sp->next) {
+    if (sp->base >= next &&
+        (n != RESIDENT_SEGMENTS || sp->base < bases[n - 1])) {
+      if (n != RESIDENT_SEGMENTS) /* else drop the highest */
+        ++n;
+      for (i = n - 1; i != 0 && bases[i - 1] > sp->base; --i) {
+        bases[i] = bases[i - 1];
+        sizes[i] = sizes[i - 1];
+      }
+      bases[i] = sp->base;
+      sizes[i] = sp->size;
+    }
+  }
+  return n;
+}
+
+/*
+  The number of resident bytes in the segments of m, locking m only to
+  copy out the next RESIDENT_SEGMENTS of them, so that the pages are
+  examined without holding the lock. Segments are taken in address
+  order, each batch resuming at the end of the last segment copied, so
+  segments added or released meanwhile do not cause others to be
+  counted twice or skipped.
+*/
+static size_t resident_bytes(mstate m) {
+  size_t result = 0;
+  char* next = 0; /* segments below next have been examined */
+  for (;;) {
+    char* bases[RESIDENT_SEGMENTS];
+    size_t sizes[RESIDENT_SEGMENTS];
+    size_t n = 0, i;
+    if (PREACTION(m))
+      break;
+    if (is_initialized(m))
+      n = next_segments(m, next, bases, sizes);
+    POSTACTION(m);
+    for (i = 0; i != n; ++i)
+      result += resident_pages(bases[i], sizes[i]);
+    if (n != RESIDENT_SEGMENTS)
+      break;
+    next = bases[n - 1] + sizes[n - 1];
+  }
+  return result;
+}
+
+#endif /* USE_RESIDENT_BYTES */
+
 /* -----------------------  Direct-mmapping chunks ----------------------- */
 
 /*
@@ -3817,36 +5997,156 @@ static void internal_malloc_stats(mstate m) {
   requirements (especially in memalign).
 */
 
+#if USE_MMAP_CACHE
+
+/* Unmap the region in cache slot i */
+static void mmap_cache_evict(mstate m, size_t i) {
+  mregionptr r = &m->mmap_cache[i];
+  if (CALL_MUNMAP(r->base, r->size) == 0)
+    m->footprint -= r->size;
+  m->mmap_cached -= r->size;
+  r->base = 0;
+}
+
+/* Unmap all cached regions, returning the number of bytes released */
+static size_t mmap_cache_flush(mstate m) {
+  size_t released = m->mmap_cached;
+  size_t i;
+  for (i = 0; i != MMAP_CACHE_SLOTS; ++i)
+    if (m->mmap_cache[i].base != 0)
+      mmap_cache_evict(m, i);
+  return released;
+}
+
+/* Advance the clock, unmapping regions that have not been reused */
+static void mmap_cache_age(mstate m) {
+  size_t i;
+  ++m->mmap_clock;
+  if (m->mmap_cached != 0) {
+    for (i = 0; i != MMAP_CACHE_SLOTS; ++i) {
+      mregionptr r = &m->mmap_cache[i];
+      if (r->base != 0 && m->mmap_clock - r->stamp > MMAP_CACHE_MAX_AGE)
+        mmap_cache_evict(m, i);
+    }
+  }
+}
+
+/*
+  Remove and return the smallest cached region of at least *sp bytes,
+  but at most a quarter more, setting *sp to its size; else CMFAIL.
+*/
+static char* mmap_cache_get(mstate m, size_t* sp) {
+  size_t mmsize = *sp;
+  size_t best = MMAP_CACHE_SLOTS;
+  size_t i;
+  mmap_cache_age(m);
+  for (i = 0; i != MMAP_CACHE_SLOTS; ++i) {
+    mregionptr r = &m->mmap_cache[i];
+    if (r->base != 0 && r->size >= mmsize &&
+        r->size - mmsize <= (mmsize >> 2) &&
+        (best == MMAP_CACHE_SLOTS || r->size < m->mmap_cache[best].size))
+      best = i;
+  }
+  if (best != MMAP_CACHE_SLOTS) {
+    mregionptr r = &m->mmap_cache[best];
+    char* mm = r->base;
+    *sp = r->size;
+    m->mmap_cached -= r->size;
+    r->base = 0;
+    return mm;
+  }
+  return CMFAIL;
+}
+
+/*
+  Cache the region of a freed mmapped chunk instead of unmapping it,
+  evicting the oldest regions to make room. Returns false if too big.
+*/
+static int mmap_cache_put(mstate m, char* base, size_t size) {
+  if (size <= MMAP_CACHE_MAX) {
+    mmap_cache_age(m);
+    for (;;) {
+      size_t slot = MMAP_CACHE_SLOTS;
+      size_t oldest = MMAP_CACHE_SLOTS;
+      size_t i;
+      for (i = 0; i != MMAP_CACHE_SLOTS; ++i) {
+        mregionptr r = &m->mmap_cache[i];
+        if (r->base == 0)
+          slot = i;
+        else if (oldest == MMAP_CACHE_SLOTS ||
+                 r->stamp < m->mmap_cache[oldest].stamp)
+          oldest = i;
+      }
+      if (slot != MMAP_CACHE_SLOTS && m->mmap_cached + size <= MMAP_CACHE_MAX) {
+        mregionptr r = &m->mmap_cache[slot];
+        r->base = base;
+        r->size = size;
+        r->stamp = m->mmap_clock;
+        m->mmap_cached += size;
+        return 1;
+      }
+      mmap_cache_evict(m, oldest);
+    }
+  }
+  return 0;
+}
+
+#endif /* USE_MMAP_CACHE */
+
 /* Malloc using mmap */
 static void* mmap_alloc(mstate m, size_t nb) {
   size_t mmsize = mmap_align(nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK);
-  if (m->footprint_limit != 0) {
-    size_t fp = m->footprint + mmsize;
-    if (fp <= m->footprint || fp > m->footprint_limit)
+  char* mm = CMFAIL;
+  flag_t cached = 0;
+  if (mmsize <= nb)     /* Check for wrap around 0 */
+    return 0;
+  if (m->mflags & NO_GROW_BIT)
+    return 0;
+#if USE_MMAP_CACHE
+  if ((mm = mmap_cache_get(m, &mmsize)) != CMFAIL)
+    cached = FLAG4_BIT; /* contents not cleared */
+#endif /* USE_MMAP_CACHE */
+  if (mm == CMFAIL) {
+    if (m->footprint_limit != 0) {
+      size_t fp = m->footprint + mmsize;
+#if USE_MMAP_CACHE
+      if (fp > m->footprint_limit && mmap_cache_flush(m) != 0)
+        fp = m->footprint + mmsize;
+#endif /* USE_MMAP_CACHE */
+      if (fp <= m->footprint || fp > m->footprint_limit) {
+#if USE_PRESSURE_HANDLERS
+        note_pressure_need(m, fp);
+#endif /* USE_PRESSURE_HANDLERS */
+        return 0;
+      }
+    }
+    mm = (char*)(CALL_DIRECT_MMAP(mmsize));
+    if (mm == CMFAIL)
       return 0;
+#if USE_NUMA
+    numa_bind(mm, mmsize, m->numa_node);
+#endif /* USE_NUMA */
+    if (m->least_addr == 0 || mm < m->least_addr)
+      m->least_addr = mm;
+    if ((m->footprint += mmsize) > m->max_footprint)
+      m->max_footprint = m->footprint;
+#if USE_PRESSURE_HANDLERS
+    note_pressure_level(m);
+#endif /* USE_PRESSURE_HANDLERS */
   }
-  if (mmsize > nb) {     /* Check for wrap around 0 */
-    char* mm = (char*)(CALL_DIRECT_MMAP(mmsize));
-    if (mm != CMFAIL) {
-      size_t offset = align_offset(chunk2mem(mm));
-      size_t psize = mmsize - offset - MMAP_FOOT_PAD;
-      mchunkptr p = (mchunkptr)(mm + offset);
-      p->prev_foot = offset;
-      p->head = psize;
-      mark_inuse_foot(m, p, psize);
-      chunk_plus_offset(p, psize)->head = FENCEPOST_HEAD;
-      chunk_plus_offset(p, psize+SIZE_T_SIZE)->head = 0;
-
-      if (m->least_addr == 0 || mm < m->least_addr)
-        m->least_addr = mm;
-      if ((m->footprint += mmsize) > m->max_footprint)
-        m->max_footprint = m->footprint;
-      assert(is_aligned(chunk2mem(p)));
-      check_mmapped_chunk(m, p);
-      return chunk2mem(p);
-    }
+  {
+    size_t offset = align_offset(chunk2mem(mm));
+    size_t psize = mmsize - offset - MMAP_FOOT_PAD;
+    mchunkptr p = (mchunkptr)(mm + offset);
+    p->prev_foot = offset;
+    p->head = psize|cached;
+    mark_inuse_foot(m, p, psize);
+    chunk_plus_offset(p, psize)->head = FENCEPOST_HEAD;
+    chunk_plus_offset(p, psize+SIZE_T_SIZE)->head = 0;
+    assert(is_aligned(chunk2mem(p)));
+    check_mmapped_chunk(m, p);
+    return chunk2mem(p);
   }
-  return 0;
 }
 
 /* Realloc using mmap */
@@ -3885,6 +6185,25 @@ static mchunkptr mmap_resize(mstate m, mchunkptr oldp, size_t nb, int flags) {
 }
 
 
+#if USE_ADAPTIVE_MMAP_THRESHOLD
+/*
+  Called when freeing an mmapped chunk of size s: raise the mmap
+  threshold (and trim threshold) so that chunks of this size are
+  allocated from the heap in the future.
+*/
+static void adapt_mmap_threshold(size_t s) {
+  if (s > mparams.mmap_threshold && s <= mparams.max_mmap_threshold) {
+    ACQUIRE_MALLOC_GLOBAL_LOCK();
+    if (s > mparams.mmap_threshold && s <= mparams.max_mmap_threshold) {
+      mparams.mmap_threshold = s;
+      mparams.trim_threshold = s << 1;
+      ++mparams.mmap_threshold_changes;
+    }
+    RELEASE_MALLOC_GLOBAL_LOCK();
+  }
+}
+#endif /* USE_ADAPTIVE_MMAP_THRESHOLD */
+
 /* -------------------------- mspace management -------------------------- */
 
 /* Initialize top chunk and its size */
@@ -3924,6 +6243,12 @@ static void reset_on_error(mstate m) {
   m->seg.base = 0;
   m->seg.size = 0;
   m->seg.next = 0;
+#if USE_SEGMENT_INDEX
+  segindex_free(m);
+#endif /* USE_SEGMENT_INDEX */
+#if USE_INCREMENTAL_RELEASE
+  m->free_seg = 0;
+#endif /* USE_INCREMENTAL_RELEASE */
   m->top = m->dv = 0;
   for (i = 0; i < NTREEBINS; ++i)
     *treebin_at(m, i) = 0;
@@ -3989,6 +6314,9 @@ static void add_segment(mstate m, char* tbase, size_t tsize, flag_t mmapped) {
   mchunkptr tnext = chunk_plus_offset(sp, ssize);
   mchunkptr p = tnext;
   int nfences = 0;
+#if USE_SEGMENT_INDEX
+  size_t si = (m->segindex == 0)? 0 : segindex_search(m, m->seg.base) - 1;
+#endif /* USE_SEGMENT_INDEX */
 
   /* reset top to new space */
   init_top(m, (mchunkptr)tbase, tsize - TOP_FOOT_SIZE);
@@ -4001,6 +6329,20 @@ static void add_segment(mstate m, char* tbase, size_t tsize, flag_t mmapped) {
   m->seg.size = tsize;
   m->seg.sflags = mmapped;
   m->seg.next = ss;
+#if USE_INCREMENTAL_RELEASE
+  ss->prev = &m->seg;
+  if (ss->next != 0)
+    ss->next->prev = ss;
+#endif /* USE_INCREMENTAL_RELEASE */
+#if USE_SEGMENT_INDEX
+  if (m->segindex != 0) { /* the pushed record moved to ss */
+    assert(m->segindex[si] == &m->seg);
+    m->segindex[si] = ss;
+    segindex_insert(m, &m->seg);
+  }
+  else
+    segindex_build(m);
+#endif /* USE_SEGMENT_INDEX */
 
   /* Insert trailing fenceposts */
   for (;;) {
@@ -4033,10 +6375,16 @@ static void* sys_alloc(mstate m, size_t nb) {
   char* tbase = CMFAIL;
   size_t tsize = 0;
   flag_t mmap_flag = 0;
+  flag_t lock_flag = 0;
   size_t asize; /* allocation size */
 
   ensure_initialization();
 
+  if (m->mflags & NO_GROW_BIT) { /* never obtain memory outside the space */
+    MALLOC_FAILURE_ACTION;
+    return 0;
+  }
+
   /* Directly map large chunks, but only if already initialized */
   if (use_mmap(m) && nb >= mparams.mmap_threshold && m->topsize != 0) {
     void* mem = mmap_alloc(m, nb);
@@ -4049,8 +6397,16 @@ static void* sys_alloc(mstate m, size_t nb) {
     return 0; /* wraparound */
   if (m->footprint_limit != 0) {
     size_t fp = m->footprint + asize;
-    if (fp <= m->footprint || fp > m->footprint_limit)
+#if USE_MMAP_CACHE
+    if (fp > m->footprint_limit && mmap_cache_flush(m) != 0)
+      fp = m->footprint + asize;
+#endif /* USE_MMAP_CACHE */
+    if (fp <= m->footprint || fp > m->footprint_limit) {
+#if USE_PRESSURE_HANDLERS
+      note_pressure_need(m, fp);
+#endif /* USE_PRESSURE_HANDLERS */
       return 0;
+    }
   }
 
   /*
@@ -4136,8 +6492,24 @@ static void* sys_alloc(mstate m, size_t nb) {
     RELEASE_MALLOC_GLOBAL_LOCK();
   }
 
+#if USE_RESERVED_MSPACES
+  if (m->reserve_end != 0) { /* Try committing more of the reservation */
+    msegmentptr ss = segment_holding(m, (char*)m->top);
+    if (ss != 0 && is_reserved_segment(ss)) {
+      char* end = ss->base + ss->size;
+      size_t csize = granularity_align(nb - m->topsize + SYS_ALLOC_PADDING);
+      if (csize < HALF_MAX_SIZE_T &&
+          csize <= (size_t)(m->reserve_end - end) &&
+          commit_reserved(end, csize) == 0) {
+        tbase = end;
+        tsize = csize;
+      }
+    }
+  }
+#endif /* USE_RESERVED_MSPACES */
+
   if (HAVE_MMAP && tbase == CMFAIL) {  /* Try MMAP */
-    char* mp = (char*)(CALL_MMAP(asize));
+    char* mp = (char*)(CALL_SEGMENT_MMAP(asize));
     if (mp != CMFAIL) {
       tbase = mp;
       tsize = asize;
@@ -4165,15 +6537,24 @@ static void* sys_alloc(mstate m, size_t nb) {
 
   if (tbase != CMFAIL) {
 
+#if USE_NUMA
+    numa_bind(tbase, tsize, m->numa_node);
+#endif /* USE_NUMA */
+#if USE_PREFAULT_MSPACES
+    lock_flag = prefault_memory(m, tbase, tsize);
+#endif /* USE_PREFAULT_MSPACES */
     if ((m->footprint += tsize) > m->max_footprint)
       m->max_footprint = m->footprint;
+#if USE_PRESSURE_HANDLERS
+    note_pressure_level(m);
+#endif /* USE_PRESSURE_HANDLERS */
 
     if (!is_initialized(m)) { /* first-time initialization */
       if (m->least_addr == 0 || tbase < m->least_addr)
         m->least_addr = tbase;
       m->seg.base = tbase;
       m->seg.size = tsize;
-      m->seg.sflags = mmap_flag;
+      m->seg.sflags = mmap_flag | lock_flag;
       m->magic = mparams.magic;
       m->release_checks = MAX_RELEASE_CHECK_RATE;
       init_bins(m);
@@ -4192,6 +6573,14 @@ static void* sys_alloc(mstate m, size_t nb) {
     else {
       /* Try to merge with an existing segment */
       msegmentptr sp = &m->seg;
+#if USE_SEGMENT_INDEX
+      if (m->segindex != 0) {
+        sp = segment_holding(m, tbase - 1);
+        if (sp != 0 && tbase != sp->base + sp->size)
+          sp = 0;
+      }
+      else
+#endif /* USE_SEGMENT_INDEX */
       /* Only consider most recent segment if traversal suppressed */
       while (sp != 0 && tbase != sp->base + sp->size)
         sp = (NO_SEGMENT_TRAVERSAL) ? 0 : sp->next;
@@ -4200,12 +6589,23 @@ static void* sys_alloc(mstate m, size_t nb) {
           (sp->sflags & USE_MMAP_BIT) == mmap_flag &&
           segment_holds(sp, m->top)) { /* append */
         sp->size += tsize;
+#if USE_PREFAULT_MSPACES
+        merge_locked(sp, tbase, tsize, lock_flag);
+#endif /* USE_PREFAULT_MSPACES */
         init_top(m, m->top, m->topsize + tsize);
       }
       else {
         if (tbase < m->least_addr)
           m->least_addr = tbase;
         sp = &m->seg;
+#if USE_SEGMENT_INDEX
+        if (m->segindex != 0) {
+          sp = segment_holding(m, tbase + tsize);
+          if (sp != 0 && sp->base != tbase + tsize)
+            sp = 0;
+        }
+        else
+#endif /* USE_SEGMENT_INDEX */
         while (sp != 0 && sp->base != tbase + tsize)
           sp = (NO_SEGMENT_TRAVERSAL) ? 0 : sp->next;
         if (sp != 0 &&
@@ -4214,10 +6614,13 @@ static void* sys_alloc(mstate m, size_t nb) {
           char* oldbase = sp->base;
           sp->base = tbase;
           sp->size += tsize;
+#if USE_PREFAULT_MSPACES
+          merge_locked(sp, tbase, tsize, lock_flag);
+#endif /* USE_PREFAULT_MSPACES */
           return prepend_alloc(m, tbase, oldbase, nb);
         }
         else
-          add_segment(m, tbase, tsize, mmap_flag);
+          add_segment(m, tbase, tsize, mmap_flag | lock_flag);
       }
     }
 
@@ -4264,15 +6667,27 @@ static size_t release_unused_segments(mstate m) {
         else {
           unlink_large_chunk(m, tp);
         }
+#if USE_SEGMENT_INDEX
+        segindex_remove(m, sp); /* while the record is still mapped */
+#endif /* USE_SEGMENT_INDEX */
         if (CALL_MUNMAP(base, size) == 0) {
           released += size;
           m->footprint -= size;
+#if USE_INCREMENTAL_RELEASE
+          if (sp == m->free_seg)
+            m->free_seg = 0;
+          if (next != 0)
+            next->prev = pred;
+#endif /* USE_INCREMENTAL_RELEASE */
           /* unlink obsoleted record */
           sp = pred;
           sp->next = next;
         }
         else { /* back out if cannot unmap */
           insert_large_chunk(m, tp, psize);
+#if USE_SEGMENT_INDEX
+          segindex_insert(m, sp);
+#endif /* USE_SEGMENT_INDEX */
         }
       }
     }
@@ -4287,6 +6702,69 @@ static size_t release_unused_segments(mstate m) {
   return released;
 }
 
+#if USE_INCREMENTAL_RELEASE
+/*
+  Unmap and unlink segment sp if it holds only one free chunk, followed
+  by its record. (This also covers segments whose record was placed at
+  the old top, below the usual TOP_FOOT_SIZE.)
+*/
+static size_t release_segment(mstate m, msegmentptr sp) {
+  char* base = sp->base;
+  size_t size = sp->size;
+  msegmentptr pred = sp->prev;
+  msegmentptr next = sp->next;
+  mchunkptr p = align_as_chunk(base);
+  size_t psize = chunksize(p);
+  assert(sp != &m->seg && pred != 0 && pred->next == sp);
+  if (is_mmapped_segment(sp) && !is_extern_segment(sp) &&
+      !is_inuse(p) && chunk_plus_offset(p, psize) == mem2chunk(sp)) {
+    tchunkptr tp = (tchunkptr)p;
+    if (p == m->dv) {
+      m->dv = 0;
+      m->dvsize = 0;
+    }
+    else {
+      unlink_large_chunk(m, tp);
+    }
+#if USE_SEGMENT_INDEX
+    segindex_remove(m, sp);
+#endif /* USE_SEGMENT_INDEX */
+    if (CALL_MUNMAP(base, size) == 0) {
+      m->footprint -= size;
+      pred->next = next;
+      if (next != 0)
+        next->prev = pred;
+      return size;
+    }
+    insert_large_chunk(m, tp, psize);
+#if USE_SEGMENT_INDEX
+    segindex_insert(m, sp);
+#endif /* USE_SEGMENT_INDEX */
+  }
+  return 0;
+}
+
+/*
+  Called when free chunk p of size psize has been binned. If it spans
+  a whole segment, remember the segment, releasing the one remembered
+  before if still unused. Such a chunk is followed by the record of its
+  segment, as no other chunk is followed by a fencepost.
+*/
+static void note_free_segment(mstate m, mchunkptr p, size_t psize) {
+  mchunkptr q = chunk_plus_offset(p, psize);
+  if (inline_trim() && chunksize(q) == pad_request(sizeof(msegment)) &&
+      chunk_plus_offset(q, chunksize(q))->head == FENCEPOST_HEAD) {
+    msegmentptr sp = (msegmentptr)(chunk2mem(q));
+    if (p == align_as_chunk(sp->base) && sp != m->free_seg) {
+      msegmentptr old = m->free_seg;
+      m->free_seg = sp;
+      if (old != 0)
+        release_segment(m, old);
+    }
+  }
+}
+#endif /* USE_INCREMENTAL_RELEASE */
+
 static int sys_trim(mstate m, size_t pad) {
   size_t released = 0;
   ensure_initialization();
@@ -4301,6 +6779,14 @@ static int sys_trim(mstate m, size_t pad) {
       msegmentptr sp = segment_holding(m, (char*)m->top);
 
       if (!is_extern_segment(sp)) {
+#if USE_RESERVED_MSPACES
+        if (is_reserved_segment(sp)) {
+          if (sp->size >= extra &&
+              decommit_reserved(sp->base + sp->size - extra, extra) == 0)
+            released = extra;
+        }
+        else
+#endif /* USE_RESERVED_MSPACES */
         if (is_mmapped_segment(sp)) {
           if (HAVE_MMAP &&
               sp->size >= extra &&
@@ -4352,37 +6838,230 @@ static int sys_trim(mstate m, size_t pad) {
   return (released != 0)? 1 : 0;
 }
 
-/* Consolidate and bin a chunk. Differs from exported versions
-   of free mainly in that the chunk need not be marked as inuse.
+#if USE_PAGE_PURGING
+
+/* The unit in which pages are purged */
+#if USE_HUGE_PAGES
+#define PURGE_UNIT          HUGE_PAGE_SIZE
+#else /* USE_HUGE_PAGES */
+#define PURGE_UNIT          mparams.page_size
+#endif /* USE_HUGE_PAGES */
+
+#define is_purged(p)        flag4inuse(p)
+#define set_purged(p)       set_flag4(p)
+
+/*
+  Purge the whole pages of free chunk p beyond its tree chunk fields,
+  unless it is already purged or too small, and mark it as purged.
+  Returns the number of bytes purged.
 */
-static void dispose_chunk(mstate m, mchunkptr p, size_t psize) {
-  mchunkptr next = chunk_plus_offset(p, psize);
-  if (!pinuse(p)) {
-    mchunkptr prev;
-    size_t prevsize = p->prev_foot;
-    if (is_mmapped(p)) {
-      psize += prevsize + MMAP_FOOT_PAD;
-      if (CALL_MUNMAP((char*)p - prevsize, psize) == 0)
-        m->footprint -= psize;
-      return;
-    }
-    prev = chunk_minus_offset(p, prevsize);
-    psize += prevsize;
-    p = prev;
-    if (RTCHECK(ok_address(m, prev))) { /* consolidate backward */
-      if (p != m->dv) {
-        unlink_chunk(m, p, prevsize);
-      }
-      else if ((next->head & INUSE_BITS) == INUSE_BITS) {
-        m->dvsize = psize;
-        set_free_with_pinuse(p, psize, next);
-        return;
-      }
-    }
-    else {
-      CORRUPTION_ERROR_ACTION(m);
-      return;
-    }
+static size_t purge_chunk(mstate m, mchunkptr p) {
+  size_t purged = 0;
+  if (!is_purged(p) && chunksize(p) >= PURGE_MIN_SIZE) {
+    size_t mask = PURGE_UNIT - SIZE_T_ONE;
+    char* start = (char*)(((size_t)p + sizeof(struct malloc_tree_chunk) +
+                           mask) & ~mask);
+    char* end = (char*)(((size_t)p + chunksize(p)) & ~mask);
+    if (start < end && !prefaults(m) &&
+        !is_extern_segment(segment_holding(m, (char*)p)) &&
+        madvise(start, (size_t)(end - start), PURGE_ADVICE) == 0)
+      purged = (size_t)(end - start);
+    set_purged(p);
+  }
+  return purged;
+}
+
+/* Purge the chunks in the tree rooted at t */
+static size_t purge_tree(mstate m, tchunkptr t) {
+  size_t purged = 0;
+  while (t != 0) {
+    tchunkptr u = t;
+    do { /* chunks of the same size as t */
+      purged += purge_chunk(m, (mchunkptr)u);
+      u = u->fd;
+    } while (u != t);
+    purged += purge_tree(m, t->child[0]);
+    t = t->child[1];
+  }
+  return purged;
+}
+
+/* Purge all large enough binned chunks. Called with m locked */
+static size_t purge_free_chunks(mstate m) {
+  size_t purged = 0;
+  bindex_t i;
+  m->unpurged = 0;
+  for (i = 0; i != NTREEBINS; ++i) {
+    if (treemap_is_marked(m, i) &&
+        (i == NTREEBINS-1 || minsize_for_tree_index(i+1) > PURGE_MIN_SIZE))
+      purged += purge_tree(m, *treebin_at(m, i));
+  }
+  return purged;
+}
+
+/* Account for a large chunk being freed, purging if enough have been */
+#define note_large_free(M, S) {\
+  if (((M)->unpurged += (S)) >= mparams.purge_threshold && inline_trim())\
+    purge_free_chunks(M);\
+}
+
+#endif /* USE_PAGE_PURGING */
+
+#if USE_BACKGROUND_PURGE
+
+/* ------------------------- background purging -------------------------- */
+
+/*
+  Take one sample of m, trimming top by the least amount it has had
+  free over the last PURGE_DECAY_STEPS samples. Once per decay time,
+  also release unused segments and purge free chunks.
+*/
+static void decay_purge(mstate m) {
+  if (!PREACTION(m)) {
+    if (is_initialized(m)) {
+      size_t low = m->topsize;
+      size_t i;
+      for (i = 0; i != PURGE_DECAY_STEPS; ++i)
+        if (m->decay_tops[i] < low)
+          low = m->decay_tops[i];
+      m->decay_tops[m->decay_step] = m->topsize;
+      if (++m->decay_step == PURGE_DECAY_STEPS) {
+        m->decay_step = 0;
+#if USE_FASTBINS
+        consolidate_fast_chunks(m);
+#endif /* USE_FASTBINS */
+        if (HAVE_MMAP)
+          release_unused_segments(m);
+#if USE_MMAP_CACHE
+        mmap_cache_flush(m);
+#endif /* USE_MMAP_CACHE */
+#if USE_PAGE_PURGING
+        if (m->unpurged != 0)
+          purge_free_chunks(m);
+#endif /* USE_PAGE_PURGING */
+      }
+      if (low > TOP_FOOT_SIZE + mparams.granularity)
+        sys_trim(m, m->topsize - low);
+    }
+    POSTACTION(m);
+  }
+}
+
+/* The purger thread; exits once no space is left in purge_list */
+static void* purge_thread(void* arg) {
+  (void)arg;
+  for (;;) {
+    mstate m;
+    struct timespec ts;
+    size_t decay = mparams.purge_decay;
+    ts.tv_sec = (time_t)(decay / PURGE_DECAY_STEPS);
+    ts.tv_nsec = (long)(decay % PURGE_DECAY_STEPS) *
+      (1000000000L / PURGE_DECAY_STEPS);
+    nanosleep(&ts, 0);
+    ACQUIRE_LOCK(&purge_mutex);
+    if (purge_list == 0) {
+      purge_running = 0;
+      RELEASE_LOCK(&purge_mutex);
+      return 0;
+    }
+    for (m = purge_list; m != 0; m = m->next_purge) {
+      decay_purge(m);
+#if USE_ARENAS
+      if (is_global(m)) {
+        size_t i;
+        for (i = 1; i < MAX_ARENAS; ++i)
+          if (arenas[i] != 0)
+            decay_purge(arenas[i]);
+      }
+#endif /* USE_ARENAS */
+    }
+    RELEASE_LOCK(&purge_mutex);
+  }
+}
+
+/*
+  Add m to or remove it from the purger, starting the thread if
+  needed, and return the previous setting. The thread is started
+  before locking m, since creating it may itself call malloc.
+*/
+static int set_background_purge(mstate m, int enable) {
+  int ret = 0;
+  ensure_initialization();
+  if (!use_lock(m)) { /* the purger could not exclude its owner */
+    USAGE_ERROR_ACTION(m, m);
+    return 0;
+  }
+  ACQUIRE_LOCK(&purge_mutex);
+  if (enable && !purge_running) {
+    pthread_t t;
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr) == 0) {
+      if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
+          pthread_create(&t, &attr, purge_thread, 0) == 0)
+        purge_running = 1;
+      pthread_attr_destroy(&attr);
+    }
+  }
+  if (!PREACTION(m)) {
+    ret = (m->mflags & PURGE_BIT) != 0;
+    if (enable && !ret && purge_running) {
+      m->mflags |= PURGE_BIT;
+      m->next_purge = purge_list;
+      purge_list = m;
+    }
+    else if (!enable && ret) {
+      mstate* pp = &purge_list;
+      while (*pp != m)
+        pp = &(*pp)->next_purge;
+      *pp = m->next_purge;
+      m->mflags &= ~PURGE_BIT;
+    }
+    POSTACTION(m);
+  }
+  RELEASE_LOCK(&purge_mutex);
+  return ret;
+}
+
+#endif /* USE_BACKGROUND_PURGE */
+
+/* Consolidate and bin a chunk. Differs from exported versions
+   of free mainly in that the chunk need not be marked as inuse.
+*/
+static void dispose_chunk(mstate m, mchunkptr p, size_t psize) {
+  mchunkptr next = chunk_plus_offset(p, psize);
+  if (!pinuse(p)) {
+    mchunkptr prev;
+    size_t prevsize = p->prev_foot;
+    if (is_mmapped(p)) {
+#if USE_ADAPTIVE_MMAP_THRESHOLD
+      adapt_mmap_threshold(psize);
+#endif /* USE_ADAPTIVE_MMAP_THRESHOLD */
+      psize += prevsize + MMAP_FOOT_PAD;
+#if USE_MMAP_CACHE
+      if (mmap_cache_put(m, (char*)p - prevsize, psize))
+        return;
+#endif /* USE_MMAP_CACHE */
+      if (CALL_MUNMAP((char*)p - prevsize, psize) == 0)
+        m->footprint -= psize;
+      return;
+    }
+    prev = chunk_minus_offset(p, prevsize);
+    psize += prevsize;
+    p = prev;
+    if (RTCHECK(ok_address(m, prev))) { /* consolidate backward */
+      if (p != m->dv) {
+        unlink_chunk(m, p, prevsize);
+      }
+      else if ((next->head & INUSE_BITS) == INUSE_BITS) {
+        m->dvsize = psize;
+        set_free_with_pinuse(p, psize, next);
+        return;
+      }
+    }
+    else {
+      CORRUPTION_ERROR_ACTION(m);
+      return;
+    }
   }
   if (RTCHECK(ok_address(m, next))) {
     if (!cinuse(next)) {  /* consolidate forward */
@@ -4417,12 +7096,453 @@ static void dispose_chunk(mstate m, mchunkptr p, size_t psize) {
       set_free_with_pinuse(p, psize, next);
     }
     insert_chunk(m, p, psize);
+#if USE_PAGE_PURGING
+    if (!is_small(psize))
+      note_large_free(m, psize);
+#endif /* USE_PAGE_PURGING */
   }
   else {
     CORRUPTION_ERROR_ACTION(m);
   }
 }
 
+#if USE_FASTBINS
+
+/* Defer coalescing of a freed chunk of at most MAX_FAST_CHUNK bytes */
+#define insert_fast_chunk(M, P, S) {\
+  bindex_t I = small_index(S);\
+  (P)->fd = (M)->fastbins[I];\
+  (M)->fastbins[I] = (P);\
+  mark_fastmap(M, I);\
+}
+
+/* Take the first chunk from nonempty fastbin I, leaving it in use */
+#define unlink_first_fast_chunk(M, P, I) {\
+  P = (M)->fastbins[I];\
+  if (((M)->fastbins[I] = (P)->fd) == 0)\
+    clear_fastmap(M, I);\
+}
+
+/* Coalesce and bin all chunks held in m's fastbins */
+static void consolidate_fast_chunks(mstate m) {
+  while (m->fastmap != 0) {
+    binmap_t leastbit = least_bit(m->fastmap);
+    bindex_t i;
+    mchunkptr p;
+    compute_bit2idx(leastbit, i);
+    p = m->fastbins[i];
+    m->fastbins[i] = 0;
+    clear_fastmap(m, i);
+    while (p != 0) {
+      mchunkptr next = p->fd;
+      check_inuse_chunk(m, p);
+      dispose_chunk(m, p, chunksize(p));
+      p = next;
+    }
+  }
+}
+
+#endif /* USE_FASTBINS */
+
+#if USE_SLABS
+
+/*
+  Slabs are SLAB_SIZE-aligned blocks within a region reserved on first
+  use, each holding objects of one size class. A slab's header records
+  its owning malloc_state (0 while in the common pool of free slabs)
+  and a bitmap of its free objects. Slabs with free objects are kept
+  in per-class lists headed in their owner's slabs array; other slabs
+  are reachable only through their objects.
+*/
+
+#define SLAB_MAP_WORDS   ((SLAB_SIZE / 8 + 31) / 32)
+
+struct malloc_slab {
+  mstate              owner;    /* 0 if in the common pool */
+  struct malloc_slab* next;     /* list of partially used slabs */
+  struct malloc_slab* prev;
+  size_t              size;     /* object size */
+  unsigned int        nobjs;    /* number of objects */
+  unsigned int        nfree;    /* number of free objects */
+  binmap_t            freemap[SLAB_MAP_WORDS]; /* set bits are free */
+};
+
+typedef struct malloc_slab* slabptr;
+
+#define SLAB_HEADER_SIZE\
+  ((sizeof(struct malloc_slab) + CHUNK_ALIGN_MASK) & ~CHUNK_ALIGN_MASK)
+
+#define slab_class(B)       (((B) == 0)? 0 : ((B) - 1) >> 3)
+#define slab_objects(S)     ((unsigned int)((SLAB_SIZE - SLAB_HEADER_SIZE) / (S)))
+#define slab_of(mem)        ((slabptr)((size_t)(mem) & ~((size_t)SLAB_SIZE - 1)))
+#define slab_object(S, i)   ((char*)(S) + SLAB_HEADER_SIZE + (i) * (S)->size)
+
+/* The region holding all slabs, and the used and committed parts of it */
+static char* slab_base;
+static char* slab_top;
+static char* slab_commit;
+static char* slab_end;
+
+#ifdef RESERVE_FLAGS
+/* The region is reserved inaccessible, and committed this much at a time */
+#define SLAB_COMMIT_SIZE    ((size_t)16U * SLAB_SIZE)
+#define reserve_slab_region(s) mmap(0, (s), PROT_NONE, RESERVE_FLAGS, -1, 0)
+#else /* RESERVE_FLAGS */
+#define reserve_slab_region(s) CALL_MMAP(s)
+#endif /* RESERVE_FLAGS */
+static slabptr free_slabs;      /* common pool of unused slabs */
+
+/* True if a request is served from slabs */
+#define is_slab_request(B)  ((B) <= SLAB_MAX_SIZE)
+
+/* True if mem was allocated from a slab */
+#define is_slab_mem(mem)\
+  ((char*)(mem) >= slab_base && (char*)(mem) < slab_top)
+
+/* Round up a small request so that its slab is aligned as malloc */
+#define align_slab_request(B)\
+  (is_slab_request(B)? ((B) + CHUNK_ALIGN_MASK + ((B) == 0)) & ~CHUNK_ALIGN_MASK : (B))
+
+/* Get an unused slab, reserving the region if needed. 0 if none */
+static slabptr get_free_slab(void) {
+  slabptr s = 0;
+  ACQUIRE_MALLOC_GLOBAL_LOCK();
+  if (slab_base == 0) {
+    char* mp = (char*)(reserve_slab_region(SLAB_REGION_SIZE + SLAB_SIZE));
+    if (mp != CMFAIL) {
+      slab_base = slab_top = (char*)(((size_t)mp + SLAB_SIZE - 1) &
+                                     ~((size_t)SLAB_SIZE - 1));
+      slab_end = slab_base + SLAB_REGION_SIZE;
+#ifdef RESERVE_FLAGS
+      slab_commit = slab_base;
+#else /* RESERVE_FLAGS */
+      slab_commit = slab_end;
+#endif /* RESERVE_FLAGS */
+    }
+    else
+      slab_base = slab_top = slab_commit = slab_end = CMFAIL;
+  }
+  if (free_slabs != 0) {
+    s = free_slabs;
+    free_slabs = s->next;
+  }
+  else if (slab_top != slab_end) {
+#ifdef RESERVE_FLAGS
+    if (slab_top == slab_commit) {
+      size_t csize = (size_t)(slab_end - slab_commit);
+      if (csize > SLAB_COMMIT_SIZE)
+        csize = SLAB_COMMIT_SIZE;
+      if (commit_reserved(slab_commit, csize) == 0)
+        slab_commit += csize;
+    }
+#endif /* RESERVE_FLAGS */
+    if (slab_top != slab_commit) {
+      s = (slabptr)slab_top;
+      slab_top += SLAB_SIZE;
+    }
+  }
+  RELEASE_MALLOC_GLOBAL_LOCK();
+  return s;
+}
+
+/* Allocate a small object from m's slabs. Called with m locked */
+static void* slab_alloc(mstate m, size_t bytes) {
+  bindex_t c = slab_class(bytes);
+  slabptr s = m->slabs[c];
+  binmap_t bit;
+  bindex_t i;
+  unsigned int w;
+  if (s == 0) {
+    if (!is_initialized(m) || /* leave first-time setup to sys_alloc */
+        (m->mflags & NO_GROW_BIT) ||
+        (m->footprint_limit != 0 &&
+         m->footprint + SLAB_SIZE > m->footprint_limit) ||
+        (s = get_free_slab()) == 0)
+      return 0;
+    s->owner = m;
+    s->next = s->prev = 0;
+    s->size = (size_t)(c + 1) << 3;
+    s->nobjs = s->nfree = slab_objects(s->size);
+    for (w = 0; w != SLAB_MAP_WORDS; ++w) {
+      unsigned int k = w << 5;
+      s->freemap[w] = (k + 32 <= s->nobjs)? ~(binmap_t)0 :
+        (k < s->nobjs)? (idx2bit(s->nobjs - k) - 1) : 0;
+    }
+    m->slabs[c] = s;
+    if ((m->footprint += SLAB_SIZE) > m->max_footprint)
+      m->max_footprint = m->footprint;
+  }
+  for (w = 0; s->freemap[w] == 0; ++w)
+    ;
+  bit = least_bit(s->freemap[w]);
+  compute_bit2idx(bit, i);
+  s->freemap[w] &= ~bit;
+  if (--s->nfree == 0) { /* full; drop from list */
+    if ((m->slabs[c] = s->next) != 0)
+      s->next->prev = 0;
+    s->next = 0;
+  }
+  return slab_object(s, (w << 5) + i);
+}
+
+/* Free a slab object owned by m. Called with m locked */
+static void slab_free(mstate m, void* mem) {
+  slabptr s = slab_of(mem);
+  size_t offset = (char*)mem - slab_object(s, 0);
+  size_t k = (s->owner == m)? offset / s->size : 0;
+  if (RTCHECK(s->owner == m && k < s->nobjs && k * s->size == offset &&
+              !(s->freemap[k >> 5] & idx2bit(k & 31)))) {
+    bindex_t c = slab_class(s->size);
+    s->freemap[k >> 5] |= idx2bit(k & 31);
+    if (s->nfree++ == 0) { /* was full; add to list */
+      s->prev = 0;
+      if ((s->next = m->slabs[c]) != 0)
+        s->next->prev = s;
+      m->slabs[c] = s;
+    }
+    else if (s->nfree == s->nobjs && (s->prev != 0 || s->next != 0)) {
+      /* empty and not the only one; return to common pool */
+      if (s->prev != 0)
+        s->prev->next = s->next;
+      else
+        m->slabs[c] = s->next;
+      if (s->next != 0)
+        s->next->prev = s->prev;
+      s->owner = 0;
+      m->footprint -= SLAB_SIZE;
+      ACQUIRE_MALLOC_GLOBAL_LOCK();
+      s->next = free_slabs;
+      free_slabs = s;
+      RELEASE_MALLOC_GLOBAL_LOCK();
+    }
+  }
+  else {
+    USAGE_ERROR_ACTION(m, mem);
+  }
+}
+
+/* Realloc a slab object, moving it to its owner if it does not fit */
+static void* slab_realloc(void* oldmem, size_t bytes) {
+  slabptr s = slab_of(oldmem);
+  mstate m = s->owner;
+  void* mem = oldmem;
+  if (m == 0 || !ok_magic(m)) {
+    USAGE_ERROR_ACTION(m, oldmem);
+    return 0;
+  }
+  if (bytes > s->size && (mem = internal_malloc(m, bytes)) != 0) {
+    memcpy(mem, oldmem, s->size);
+    internal_free(m, oldmem);
+  }
+  return mem;
+}
+
+#if MSPACES
+/* Return all slabs owned by m to the common pool */
+static void release_slabs(mstate m) {
+  char* a;
+  ACQUIRE_MALLOC_GLOBAL_LOCK();
+  for (a = slab_base; a < slab_top; a += SLAB_SIZE) {
+    slabptr s = (slabptr)a;
+    if (s->owner == m) {
+      s->owner = 0;
+      s->next = free_slabs;
+      free_slabs = s;
+    }
+  }
+  RELEASE_MALLOC_GLOBAL_LOCK();
+}
+#endif /* MSPACES */
+
+#else /* USE_SLABS */
+#define is_slab_request(B)     (0)
+#define is_slab_mem(mem)       (0)
+#define align_slab_request(B)  (B)
+#endif /* USE_SLABS */
+
+#if USE_REMOTE_FREES
+
+/* True if a chunk being freed into m must be queued for its owner */
+#define is_remote_free(M)\
+  (((M)->mflags & REMOTE_FREE_BIT) && !EQ_OWNER((M)->owner, CURRENT_THREAD))
+
+/* Queue a chunk freed by a thread other than m's owner. Does not lock */
+static void push_remote_free(mstate m, mchunkptr p) {
+  mchunkptr h;
+  do {
+    h = m->remote_frees;
+    p->fd = h;
+  } while (!CAS_PTR(&m->remote_frees, h, p));
+}
+
+/*
+  Take ownership of m for the calling thread, and release any chunks
+  queued by other threads. Called with m locked (if m uses locks).
+*/
+static void release_remote_frees(mstate m) {
+  mchunkptr p;
+  if (!EQ_OWNER(m->owner, CURRENT_THREAD))
+    m->owner = CURRENT_THREAD;
+  do {
+    p = m->remote_frees;
+  } while (p != 0 && !CAS_PTR(&m->remote_frees, p, 0));
+  if (p != 0) {
+    while (p != 0) {
+      mchunkptr next = p->fd;
+#if USE_SLABS
+      if (is_slab_mem(chunk2mem(p)))
+        slab_free(m, chunk2mem(p));
+      else
+#endif /* USE_SLABS */
+      {
+        check_inuse_chunk(m, p);
+        if (RTCHECK(ok_address(m, p) && ok_inuse(p)))
+          dispose_chunk(m, p, chunksize(p));
+        else
+          USAGE_ERROR_ACTION(m, p);
+      }
+      p = next;
+    }
+    if (should_trim(m, m->topsize))
+      sys_trim(m, 0);
+  }
+}
+
+#endif /* USE_REMOTE_FREES */
+
+#if USE_THREAD_MSPACES
+
+/*
+  True if nothing in m is in use: each segment holds only a free chunk
+  or top (besides m itself), and nothing else, such as mmapped chunks
+  or slabs, counts toward its footprint. Called with m locked.
+*/
+static int is_empty_space(mstate m) {
+  size_t total = 0;
+  msegmentptr sp;
+#if USE_FASTBINS
+  consolidate_fast_chunks(m);
+#endif /* USE_FASTBINS */
+#if USE_SLABS
+  {
+    bindex_t c;
+    for (c = 0; c != NSLABCLASSES; ++c) {
+      slabptr s = m->slabs[c];
+      if (s != 0 && s->next == 0 && s->nfree == s->nobjs)
+        total += SLAB_SIZE; /* empty slabs kept for reuse */
+    }
+  }
+#endif /* USE_SLABS */
+#if USE_MMAP_CACHE
+  total += m->mmap_cached;
+#endif /* USE_MMAP_CACHE */
+  for (sp = &m->seg; sp != 0; sp = sp->next) {
+    mchunkptr q = (segment_holds(sp, m))? next_chunk(mem2chunk(m)) :
+      align_as_chunk(sp->base);
+    if (q != m->top && (is_inuse(q) ||
+        (char*)q + chunksize(q) < sp->base + sp->size - TOP_FOOT_SIZE))
+      return 0;
+    total += sp->size;
+  }
+  return total == m->footprint;
+}
+
+/* Remove thread mspace ms from thread_spaces and destroy it */
+static void destroy_thread_mspace(mstate ms) {
+  mstate* pp;
+  ACQUIRE_LOCK(&thread_ms_mutex);
+  for (pp = &thread_spaces; *pp != 0; pp = &(*pp)->next_thread) {
+    if (*pp == ms) {
+      *pp = ms->next_thread;
+      break;
+    }
+  }
+  RELEASE_LOCK(&thread_ms_mutex);
+  destroy_mspace(ms);
+}
+
+/* Orphan the mspace of an exiting thread, or destroy it if empty */
+static void orphan_mspace(mstate ms) {
+  int empty = 0;
+  if (!PREACTION(ms)) {
+    if (!(empty = is_empty_space(ms))) {
+      ms->mflags |= ORPHAN_BIT;
+      ACQUIRE_MALLOC_GLOBAL_LOCK();
+      ms->next_orphan = orphans;
+      orphans = ms;
+      RELEASE_MALLOC_GLOBAL_LOCK();
+    }
+    POSTACTION(ms);
+  }
+  if (empty)
+    destroy_thread_mspace(ms);
+}
+
+/*
+  Called with m locked after freeing into it. If m is an orphan that
+  is now empty, and has not meanwhile been adopted, remove it from the
+  orphans and return true, in which case the caller must destroy m
+  after unlocking it.
+*/
+static int claim_empty_orphan(mstate m) {
+  int claimed = 0;
+  if ((m->mflags & ORPHAN_BIT) && is_empty_space(m)) {
+    mstate* pp;
+    ACQUIRE_MALLOC_GLOBAL_LOCK();
+    for (pp = &orphans; *pp != 0; pp = &(*pp)->next_orphan) {
+      if (*pp == m) {
+        *pp = m->next_orphan;
+        claimed = 1;
+        break;
+      }
+    }
+    RELEASE_MALLOC_GLOBAL_LOCK();
+  }
+  return claimed;
+}
+
+/* pthread key destructor: orphan the exiting thread's mspace */
+static void thread_mspace_exit(void* ms) {
+  thread_ms = 0;
+  orphan_mspace((mstate)ms);
+}
+
+/* Unlock m after freeing into it, destroying it if an empty orphan */
+#define FREE_POSTACTION(M) {\
+  if (claim_empty_orphan(M)) {\
+    POSTACTION(M);\
+    destroy_thread_mspace(M);\
+  }\
+  else POSTACTION(M);\
+}
+
+#else /* USE_THREAD_MSPACES */
+#define FREE_POSTACTION(M)  POSTACTION(M)
+#endif /* USE_THREAD_MSPACES */
+
+#if USE_SLABS
+
+/* Free a slab object, locking its owner */
+static void free_slab_mem(void* mem) {
+  mstate m = slab_of(mem)->owner;
+  if (m == 0 || !ok_magic(m)) {
+    USAGE_ERROR_ACTION(m, mem);
+    return;
+  }
+#if USE_REMOTE_FREES
+  if (is_remote_free(m)) {
+    push_remote_free(m, mem2chunk(mem));
+    return;
+  }
+#endif /* USE_REMOTE_FREES */
+  if (!PREACTION(m)) {
+    slab_free(m, mem);
+    FREE_POSTACTION(m);
+  }
+}
+
+#endif /* USE_SLABS */
+
 /* ---------------------------- malloc --------------------------- */
 
 /* allocate a large request from the best fitting chunk in a treebin */
@@ -4534,9 +7654,288 @@ static void* tmalloc_small(mstate m, size_t nb) {
   return 0;
 }
 
+/*
+  Carve up to n chunks of at least small chunk size nb from the
+  fastbin and smallbin for nb, then dv, then top, storing their mems in mems[].
+  Returns the number obtained, which is less than n only when all of
+  these are exhausted; callers then fall back to the general malloc
+  path, which also handles getting more space from the system. Used
+  for batch allocation and refilling caches. Called with m locked.
+*/
+static size_t carve_small_chunks(mstate m, size_t nb, void** mems,
+                                 size_t n) {
+  bindex_t idx = small_index(nb);
+  size_t count = 0;
+  while (count < n) {
+    mchunkptr p;
+#if USE_FASTBINS
+    if (nb <= MAX_FAST_CHUNK && fastmap_is_marked(m, idx)) {
+      unlink_first_fast_chunk(m, p, idx);
+    }
+    else
+#endif /* USE_FASTBINS */
+    if (smallmap_is_marked(m, idx)) {
+      mchunkptr b = smallbin_at(m, idx);
+      p = b->fd;
+      assert(chunksize(p) == nb);
+      unlink_first_small_chunk(m, b, p, idx);
+      set_inuse_and_pinuse(m, p, nb);
+    }
+    else if (nb <= m->dvsize) {
+      size_t rsize = m->dvsize - nb;
+      p = m->dv;
+      if (rsize >= MIN_CHUNK_SIZE) { /* split dv */
+        mchunkptr r = m->dv = chunk_plus_offset(p, nb);
+        m->dvsize = rsize;
+        set_size_and_pinuse_of_free_chunk(r, rsize);
+        set_size_and_pinuse_of_inuse_chunk(m, p, nb);
+      }
+      else { /* exhaust dv */
+        size_t dvs = m->dvsize;
+        m->dvsize = 0;
+        m->dv = 0;
+        set_inuse_and_pinuse(m, p, dvs);
+      }
+    }
+    else if (nb < m->topsize) { /* split top */
+      size_t rsize = m->topsize -= nb;
+      mchunkptr r;
+      p = m->top;
+      r = m->top = chunk_plus_offset(p, nb);
+      r->head = rsize | PINUSE_BIT;
+      set_size_and_pinuse_of_inuse_chunk(m, p, nb);
+      check_top_chunk(m, m->top);
+    }
+    else
+      break;
+    mems[count] = chunk2mem(p);
+    check_malloced_chunk(m, mems[count], nb);
+    ++count;
+  }
+  return count;
+}
+
+#if (USE_THREAD_CACHE || USE_PERCPU_CACHE) && !ONLY_MSPACES
+
+/*
+  Return up to n chunks from the cache list at *bin, holding *count
+  chunks, to gm. Called with gm locked.
+*/
+static void release_cached_chunks(mchunkptr* bin, unsigned* count,
+                                  unsigned int n) {
+  mchunkptr p = *bin;
+  while (n-- != 0 && p != 0) {
+    mchunkptr next = p->fd;
+    check_inuse_chunk(gm, p);
+    dispose_chunk(gm, p, chunksize(p));
+    --*count;
+    p = next;
+  }
+  *bin = p;
+}
+
+#endif /* (USE_THREAD_CACHE || USE_PERCPU_CACHE) && !ONLY_MSPACES */
+
+#if USE_THREAD_CACHE && !ONLY_MSPACES
+
+/* ------------------------- per-thread caches --------------------------- */
+
+/* Return all of a thread's cached chunks to gm */
+static void tcache_flush(struct thread_cache* tc) {
+  if (!PREACTION(gm)) {
+    bindex_t i;
+    for (i = 0; i < NSMALLBINS; ++i)
+      if (tc->counts[i] != 0)
+        release_cached_chunks(&tc->bins[i], &tc->counts[i], tc->counts[i]);
+    if (should_trim(gm, gm->topsize))
+      sys_trim(gm, 0);
+    POSTACTION(gm);
+  }
+}
+
+/* pthread key destructor: flush and disable the exiting thread's cache */
+static void tcache_thread_exit(void* tc) {
+  tcache_flush((struct thread_cache*)tc);
+  ((struct thread_cache*)tc)->state = -1;
+}
+
+/*
+  Allocate from the cache, refilling it from gm if empty. Returns 0
+  if the request should instead go through the locked malloc path.
+*/
+static void* tcache_malloc(struct thread_cache* tc, size_t bytes) {
+  size_t nb = (bytes < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(bytes);
+  bindex_t idx = small_index(nb);
+  mchunkptr p = tc->bins[idx];
+  if (p != 0) {
+    tc->bins[idx] = p->fd;
+    --tc->counts[idx];
+    return chunk2mem(p);
+  }
+  if (tc->state == 0) {
+    ensure_initialization();
+    tc->state = (tcache_key_ok && pthread_setspecific(tcache_key, tc) == 0)?
+      1 : -1;
+  }
+  if (tc->state > 0 && !PREACTION(gm)) {
+    void* mems[THREAD_CACHE_BATCH];
+    size_t n = carve_small_chunks(gm, nb, mems, THREAD_CACHE_BATCH);
+    POSTACTION(gm);
+    if (n != 0) {
+      while (--n != 0) {
+        mchunkptr q = mem2chunk(mems[n]);
+        q->fd = tc->bins[idx];
+        tc->bins[idx] = q;
+        ++tc->counts[idx];
+      }
+      return mems[0];
+    }
+  }
+  return 0;
+}
+
+/*
+  Place a chunk being freed into the cache if it is a small chunk of
+  gm, flushing part of its list first if full. Returns 0 if the chunk
+  should instead be freed normally.
+*/
+static int tcache_free(struct thread_cache* tc, mstate m, mchunkptr p) {
+  size_t psize = chunksize(p);
+  if (tc->state > 0 && m == gm && is_small(psize) && cinuse(p) &&
+      RTCHECK(ok_address(gm, p))) {
+    bindex_t idx = small_index(psize);
+    if (tc->counts[idx] >= THREAD_CACHE_MAX) {
+      if (PREACTION(gm))
+        return 0;
+      release_cached_chunks(&tc->bins[idx], &tc->counts[idx],
+                            THREAD_CACHE_BATCH);
+      POSTACTION(gm);
+    }
+    p->fd = tc->bins[idx];
+    tc->bins[idx] = p;
+    ++tc->counts[idx];
+    return 1;
+  }
+  return 0;
+}
+
+#endif /* USE_THREAD_CACHE && !ONLY_MSPACES */
+
+#if USE_PERCPU_CACHE && !ONLY_MSPACES
+
+/* ------------------------ per-processor caches ------------------------- */
+
+/* Try to lock the current processor's cache, returning 0 if busy */
+static struct cpu_cache* cpucache_acquire(void) {
+  int cpu = sched_getcpu();
+  if (cpu >= 0 && (size_t)cpu < ncpu_caches) {
+    struct cpu_cache* cc = cpu_cache_at(cpu);
+    if (__sync_lock_test_and_set(&cc->lock, 1) == 0)
+      return cc;
+  }
+  return 0;
+}
+
+#define cpucache_unlock(cc)  __sync_lock_release(&(cc)->lock)
+
+/*
+  Return all chunks in caches not currently in use to gm. The lock
+  order is always a processor's cache before gm.
+*/
+static void cpucache_flush_all(void) {
+  size_t c;
+  for (c = 0; c < ncpu_caches; ++c) {
+    struct cpu_cache* cc = cpu_cache_at(c);
+    if (__sync_lock_test_and_set(&cc->lock, 1) == 0) {
+      if (!PREACTION(gm)) {
+        bindex_t i;
+        for (i = 0; i < NSMALLBINS; ++i)
+          if (cc->counts[i] != 0)
+            release_cached_chunks(&cc->bins[i], &cc->counts[i],
+                                  cc->counts[i]);
+        POSTACTION(gm);
+      }
+      cpucache_unlock(cc);
+    }
+  }
+}
+
+/*
+  Allocate from the current processor's cache, refilling it from gm if
+  empty. Returns 0 if the request should instead go through the
+  locked malloc path.
+*/
+static void* cpucache_malloc(size_t bytes) {
+  void* mem = 0;
+  struct cpu_cache* cc = cpucache_acquire();
+  if (cc != 0) {
+    size_t nb = (bytes < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(bytes);
+    bindex_t idx = small_index(nb);
+    mchunkptr p = cc->bins[idx];
+    if (p != 0) {
+      cc->bins[idx] = p->fd;
+      --cc->counts[idx];
+      mem = chunk2mem(p);
+    }
+    else if (!PREACTION(gm)) {
+      void* mems[PERCPU_CACHE_BATCH];
+      size_t n = carve_small_chunks(gm, nb, mems, PERCPU_CACHE_BATCH);
+      POSTACTION(gm);
+      if (n != 0) {
+        while (--n != 0) {
+          mchunkptr q = mem2chunk(mems[n]);
+          q->fd = cc->bins[idx];
+          cc->bins[idx] = q;
+          ++cc->counts[idx];
+        }
+        mem = mems[0];
+      }
+    }
+    cpucache_unlock(cc);
+  }
+  return mem;
+}
+
+/*
+  Place a chunk being freed into the current processor's cache if it
+  is a small chunk of gm, flushing part of its list first if full.
+  Returns 0 if the chunk should instead be freed normally.
+*/
+static int cpucache_free(mstate m, mchunkptr p) {
+  size_t psize = chunksize(p);
+  if (m == gm && is_small(psize) && cinuse(p) &&
+      RTCHECK(ok_address(gm, p))) {
+    struct cpu_cache* cc = cpucache_acquire();
+    if (cc != 0) {
+      bindex_t idx = small_index(psize);
+      if (cc->counts[idx] >= PERCPU_CACHE_MAX) {
+        if (PREACTION(gm)) {
+          cpucache_unlock(cc);
+          return 0;
+        }
+        release_cached_chunks(&cc->bins[idx], &cc->counts[idx],
+                              PERCPU_CACHE_BATCH);
+        POSTACTION(gm);
+      }
+      p->fd = cc->bins[idx];
+      cc->bins[idx] = p;
+      ++cc->counts[idx];
+      cpucache_unlock(cc);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+#endif /* USE_PERCPU_CACHE && !ONLY_MSPACES */
+
 #if !ONLY_MSPACES
 
-void* dlmalloc(size_t bytes) {
+/*
+  The allocation algorithm of malloc, called with gm locked (if gm
+  uses locks).
+*/
+static void* dlmalloc_locked(size_t bytes) {
   /*
      Basic algorithm:
      If a small request (< 256 bytes minus per-chunk overhead):
@@ -4556,122 +7955,208 @@ void* dlmalloc(size_t bytes) {
        3. If it is big enough, use the top chunk.
        4. If request size >= mmap threshold, try to directly mmap this chunk.
        5. If available, get memory from system and use it
-
-     The ugly goto's here ensure that postaction occurs along all paths.
   */
+  void* mem;
+  size_t nb;
+#if USE_SLABS
+  if (is_slab_request(bytes) && (mem = slab_alloc(gm, bytes)) != 0)
+    return mem;
+#endif /* USE_SLABS */
+  if (bytes <= MAX_SMALL_REQUEST) {
+    bindex_t idx;
+    binmap_t smallbits;
+    nb = (bytes < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(bytes);
+    idx = small_index(nb);
+#if USE_FASTBINS
+    if (nb <= MAX_FAST_CHUNK && fastmap_is_marked(gm, idx)) {
+      mchunkptr p;
+      unlink_first_fast_chunk(gm, p, idx);
+      mem = chunk2mem(p);
+      check_malloced_chunk(gm, mem, nb);
+      return mem;
+    }
+#endif /* USE_FASTBINS */
+    smallbits = gm->smallmap >> idx;
+
+    if ((smallbits & 0x3U) != 0) { /* Remainderless fit to a smallbin. */
+      mchunkptr b, p;
+      idx += ~smallbits & 1;       /* Uses next bin if idx empty */
+      b = smallbin_at(gm, idx);
+      p = b->fd;
+      assert(chunksize(p) == small_index2size(idx));
+      unlink_first_small_chunk(gm, b, p, idx);
+      set_inuse_and_pinuse(gm, p, small_index2size(idx));
+      mem = chunk2mem(p);
+      check_malloced_chunk(gm, mem, nb);
+      return mem;
+    }
 
-#if USE_LOCKS
-  ensure_initialization(); /* initialize in sys_alloc if not using locks */
-#endif
-
-  if (!PREACTION(gm)) {
-    void* mem;
-    size_t nb;
-    if (bytes <= MAX_SMALL_REQUEST) {
-      bindex_t idx;
-      binmap_t smallbits;
-      nb = (bytes < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(bytes);
-      idx = small_index(nb);
-      smallbits = gm->smallmap >> idx;
-
-      if ((smallbits & 0x3U) != 0) { /* Remainderless fit to a smallbin. */
-        mchunkptr b, p;
-        idx += ~smallbits & 1;       /* Uses next bin if idx empty */
-        b = smallbin_at(gm, idx);
+    else if (nb > gm->dvsize) {
+      if (smallbits != 0) { /* Use chunk in next nonempty smallbin */
+        mchunkptr b, p, r;
+        size_t rsize;
+        bindex_t i;
+        binmap_t leftbits = (smallbits << idx) & left_bits(idx2bit(idx));
+        binmap_t leastbit = least_bit(leftbits);
+        compute_bit2idx(leastbit, i);
+        b = smallbin_at(gm, i);
         p = b->fd;
-        assert(chunksize(p) == small_index2size(idx));
-        unlink_first_small_chunk(gm, b, p, idx);
-        set_inuse_and_pinuse(gm, p, small_index2size(idx));
+        assert(chunksize(p) == small_index2size(i));
+        unlink_first_small_chunk(gm, b, p, i);
+        rsize = small_index2size(i) - nb;
+        /* Fit here cannot be remainderless if 4byte sizes */
+        if (SIZE_T_SIZE != 4 && rsize < MIN_CHUNK_SIZE)
+          set_inuse_and_pinuse(gm, p, small_index2size(i));
+        else {
+          set_size_and_pinuse_of_inuse_chunk(gm, p, nb);
+          r = chunk_plus_offset(p, nb);
+          set_size_and_pinuse_of_free_chunk(r, rsize);
+          replace_dv(gm, r, rsize);
+        }
         mem = chunk2mem(p);
         check_malloced_chunk(gm, mem, nb);
-        goto postaction;
+        return mem;
       }
 
-      else if (nb > gm->dvsize) {
-        if (smallbits != 0) { /* Use chunk in next nonempty smallbin */
-          mchunkptr b, p, r;
-          size_t rsize;
-          bindex_t i;
-          binmap_t leftbits = (smallbits << idx) & left_bits(idx2bit(idx));
-          binmap_t leastbit = least_bit(leftbits);
-          compute_bit2idx(leastbit, i);
-          b = smallbin_at(gm, i);
-          p = b->fd;
-          assert(chunksize(p) == small_index2size(i));
-          unlink_first_small_chunk(gm, b, p, i);
-          rsize = small_index2size(i) - nb;
-          /* Fit here cannot be remainderless if 4byte sizes */
-          if (SIZE_T_SIZE != 4 && rsize < MIN_CHUNK_SIZE)
-            set_inuse_and_pinuse(gm, p, small_index2size(i));
-          else {
-            set_size_and_pinuse_of_inuse_chunk(gm, p, nb);
-            r = chunk_plus_offset(p, nb);
-            set_size_and_pinuse_of_free_chunk(r, rsize);
-            replace_dv(gm, r, rsize);
-          }
-          mem = chunk2mem(p);
-          check_malloced_chunk(gm, mem, nb);
-          goto postaction;
-        }
-
-        else if (gm->treemap != 0 && (mem = tmalloc_small(gm, nb)) != 0) {
-          check_malloced_chunk(gm, mem, nb);
-          goto postaction;
-        }
-      }
-    }
-    else if (bytes >= MAX_REQUEST)
-      nb = MAX_SIZE_T; /* Too big to allocate. Force failure (in sys alloc) */
-    else {
-      nb = pad_request(bytes);
-      if (gm->treemap != 0 && (mem = tmalloc_large(gm, nb)) != 0) {
+      else if (gm->treemap != 0 && (mem = tmalloc_small(gm, nb)) != 0) {
         check_malloced_chunk(gm, mem, nb);
-        goto postaction;
+        return mem;
       }
     }
-
-    if (nb <= gm->dvsize) {
-      size_t rsize = gm->dvsize - nb;
-      mchunkptr p = gm->dv;
-      if (rsize >= MIN_CHUNK_SIZE) { /* split dv */
-        mchunkptr r = gm->dv = chunk_plus_offset(p, nb);
-        gm->dvsize = rsize;
-        set_size_and_pinuse_of_free_chunk(r, rsize);
-        set_size_and_pinuse_of_inuse_chunk(gm, p, nb);
-      }
-      else { /* exhaust dv */
-        size_t dvs = gm->dvsize;
-        gm->dvsize = 0;
-        gm->dv = 0;
-        set_inuse_and_pinuse(gm, p, dvs);
-      }
-      mem = chunk2mem(p);
+  }
+  else if (bytes >= MAX_REQUEST)
+    nb = MAX_SIZE_T; /* Too big to allocate. Force failure (in sys alloc) */
+  else {
+    nb = pad_request(bytes);
+#if USE_FASTBINS
+    if (gm->fastmap != 0)
+      consolidate_fast_chunks(gm);
+#endif /* USE_FASTBINS */
+    if (gm->treemap != 0 && (mem = tmalloc_large(gm, nb)) != 0) {
       check_malloced_chunk(gm, mem, nb);
-      goto postaction;
+      return mem;
     }
+  }
 
-    else if (nb < gm->topsize) { /* Split top */
-      size_t rsize = gm->topsize -= nb;
-      mchunkptr p = gm->top;
-      mchunkptr r = gm->top = chunk_plus_offset(p, nb);
-      r->head = rsize | PINUSE_BIT;
+  if (nb <= gm->dvsize) {
+    size_t rsize = gm->dvsize - nb;
+    mchunkptr p = gm->dv;
+    if (rsize >= MIN_CHUNK_SIZE) { /* split dv */
+      mchunkptr r = gm->dv = chunk_plus_offset(p, nb);
+      gm->dvsize = rsize;
+      set_size_and_pinuse_of_free_chunk(r, rsize);
       set_size_and_pinuse_of_inuse_chunk(gm, p, nb);
-      mem = chunk2mem(p);
-      check_top_chunk(gm, gm->top);
-      check_malloced_chunk(gm, mem, nb);
-      goto postaction;
     }
+    else { /* exhaust dv */
+      size_t dvs = gm->dvsize;
+      gm->dvsize = 0;
+      gm->dv = 0;
+      set_inuse_and_pinuse(gm, p, dvs);
+    }
+    mem = chunk2mem(p);
+    check_malloced_chunk(gm, mem, nb);
+    return mem;
+  }
+
+  else if (nb < gm->topsize) { /* Split top */
+    size_t rsize = gm->topsize -= nb;
+    mchunkptr p = gm->top;
+    mchunkptr r = gm->top = chunk_plus_offset(p, nb);
+    r->head = rsize | PINUSE_BIT;
+    set_size_and_pinuse_of_inuse_chunk(gm, p, nb);
+    mem = chunk2mem(p);
+    check_top_chunk(gm, gm->top);
+    check_malloced_chunk(gm, mem, nb);
+    return mem;
+  }
+
+#if USE_FASTBINS
+  if (gm->fastmap != 0) { /* retry after consolidating */
+    consolidate_fast_chunks(gm);
+    return dlmalloc_locked(bytes);
+  }
+#endif /* USE_FASTBINS */
+  return sys_alloc(gm, nb);
+}
+
+void* dlmalloc(size_t bytes) {
+#if USE_THREAD_CACHE
+  if (bytes <= MAX_SMALL_REQUEST && !is_slab_request(bytes)) {
+    void* mem = tcache_malloc(&tcache, bytes);
+    if (mem != 0)
+      return mem;
+  }
+#endif /* USE_THREAD_CACHE */
+#if USE_PERCPU_CACHE
+  if (bytes <= MAX_SMALL_REQUEST && !is_slab_request(bytes)) {
+    void* mem = cpucache_malloc(bytes);
+    if (mem != 0)
+      return mem;
+  }
+#endif /* USE_PERCPU_CACHE */
 
-    mem = sys_alloc(gm, nb);
+#if USE_ARENAS
+  if (mparams.narenas > 1)
+    return arena_malloc(bytes);
+#endif /* USE_ARENAS */
 
-  postaction:
+#if USE_LOCKS
+  ensure_initialization(); /* initialize in sys_alloc if not using locks */
+#endif
+
+  if (!PREACTION(gm)) {
+    void* mem;
+#if USE_PRESSURE_HANDLERS
+    size_t need;
+    int pressure;
+#endif /* USE_PRESSURE_HANDLERS */
+    mem = dlmalloc_locked(bytes);
+#if USE_PRESSURE_HANDLERS
+    pressure = take_pressure(gm, mem == 0, &need);
+    POSTACTION(gm);
+    if (pressure)
+      mem = relieve_pressure(gm, mem, bytes, need);
+#else /* USE_PRESSURE_HANDLERS */
     POSTACTION(gm);
+#endif /* USE_PRESSURE_HANDLERS */
     return mem;
   }
 
   return 0;
 }
 
+size_t dlmalloc_batch(size_t bytes, size_t n, void** out) {
+  size_t count = 0;
+#if USE_ARENAS
+  if (mparams.narenas > 1)
+    return mspace_malloc_batch(home_arena(), bytes, n, out);
+#endif /* USE_ARENAS */
+#if USE_LOCKS
+  ensure_initialization(); /* initialize in sys_alloc if not using locks */
+#endif
+  if (!PREACTION(gm)) {
+#if USE_PRESSURE_HANDLERS
+    size_t need;
+    int pressure;
+#endif /* USE_PRESSURE_HANDLERS */
+    if (bytes <= MAX_SMALL_REQUEST && !is_slab_request(bytes)) {
+      size_t nb = (bytes < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(bytes);
+      count = carve_small_chunks(gm, nb, out, n);
+    }
+    while (count < n && (out[count] = dlmalloc_locked(bytes)) != 0)
+      ++count;
+#if USE_PRESSURE_HANDLERS
+    pressure = take_pressure(gm, count < n, &need);
+    POSTACTION(gm);
+    if (pressure) /* a short batch is not retried */
+      (void)run_pressure_handler(gm, need);
+#else /* USE_PRESSURE_HANDLERS */
+    POSTACTION(gm);
+#endif /* USE_PRESSURE_HANDLERS */
+  }
+  return count;
+}
+
 /* ---------------------------- free --------------------------- */
 
 void dlfree(void* mem) {
@@ -4681,6 +8166,12 @@ void dlfree(void* mem) {
      with special cases for top, dv, mmapped chunks, and usage errors.
   */
 
+#if USE_SLABS
+  if (is_slab_mem(mem)) {
+    free_slab_mem(mem);
+    return;
+  }
+#endif /* USE_SLABS */
   if (mem != 0) {
     mchunkptr p  = mem2chunk(mem);
 #if FOOTERS
@@ -4692,15 +8183,42 @@ void dlfree(void* mem) {
 #else /* FOOTERS */
 #define fm gm
 #endif /* FOOTERS */
+#if USE_THREAD_CACHE
+    if (tcache_free(&tcache, fm, p))
+      return;
+#endif /* USE_THREAD_CACHE */
+#if USE_PERCPU_CACHE
+    if (cpucache_free(fm, p))
+      return;
+#endif /* USE_PERCPU_CACHE */
+#if USE_REMOTE_FREES
+    if (is_remote_free(fm)) {
+      push_remote_free(fm, p);
+      return;
+    }
+#endif /* USE_REMOTE_FREES */
     if (!PREACTION(fm)) {
       check_inuse_chunk(fm, p);
       if (RTCHECK(ok_address(fm, p) && ok_inuse(p))) {
         size_t psize = chunksize(p);
         mchunkptr next = chunk_plus_offset(p, psize);
+#if USE_FASTBINS
+        if (psize <= MAX_FAST_CHUNK && !is_mmapped(p)) {
+          insert_fast_chunk(fm, p, psize);
+          goto postaction;
+        }
+#endif /* USE_FASTBINS */
         if (!pinuse(p)) {
           size_t prevsize = p->prev_foot;
           if (is_mmapped(p)) {
+#if USE_ADAPTIVE_MMAP_THRESHOLD
+            adapt_mmap_threshold(psize);
+#endif /* USE_ADAPTIVE_MMAP_THRESHOLD */
             psize += prevsize + MMAP_FOOT_PAD;
+#if USE_MMAP_CACHE
+            if (mmap_cache_put(fm, (char*)p - prevsize, psize))
+              goto postaction;
+#endif /* USE_MMAP_CACHE */
             if (CALL_MUNMAP((char*)p - prevsize, psize) == 0)
               fm->footprint -= psize;
             goto postaction;
@@ -4766,8 +8284,15 @@ void dlfree(void* mem) {
             tchunkptr tp = (tchunkptr)p;
             insert_large_chunk(fm, tp, psize);
             check_free_chunk(fm, p);
-            if (--fm->release_checks == 0)
+#if USE_INCREMENTAL_RELEASE
+            note_free_segment(fm, p, psize);
+#else /* USE_INCREMENTAL_RELEASE */
+            if (should_release(fm))
               release_unused_segments(fm);
+#endif /* USE_INCREMENTAL_RELEASE */
+#if USE_PAGE_PURGING
+            note_large_free(fm, psize);
+#endif /* USE_PAGE_PURGING */
           }
           goto postaction;
         }
@@ -4775,7 +8300,7 @@ void dlfree(void* mem) {
     erroraction:
       USAGE_ERROR_ACTION(fm, p);
     postaction:
-      POSTACTION(fm);
+      FREE_POSTACTION(fm);
     }
   }
 #if !FOOTERS
@@ -4793,7 +8318,7 @@ void* dlcalloc(size_t n_elements, size_t elem_size) {
       req = MAX_SIZE_T; /* force downstream failure on overflow */
   }
   mem = dlmalloc(req);
-  if (mem != 0 && calloc_must_clear(mem2chunk(mem)))
+  if (mem != 0 && (is_slab_mem(mem) || calloc_must_clear(mem2chunk(mem))))
     memset(mem, 0, req);
   return mem;
 }
@@ -4882,6 +8407,35 @@ static mchunkptr try_realloc_chunk(mstate m, mchunkptr p, size_t nb,
   return newp;
 }
 
+#if USE_REALLOC_MMAP
+/*
+  For realloc of a chunk that could not be resized in place, allocate
+  the new chunk directly using mmap if nb is large enough, so that it
+  can be grown using mremap from then on. Returns 0 otherwise.
+*/
+static void* realloc_mmap_alloc(mstate m, size_t nb) {
+  void* mem = 0;
+  if (nb >= mparams.mmap_threshold && !PREACTION(m)) {
+#if USE_PRESSURE_HANDLERS
+    size_t need;
+    int pressure;
+#endif /* USE_PRESSURE_HANDLERS */
+    if (use_mmap(m))
+      mem = mmap_alloc(m, nb);
+#if USE_PRESSURE_HANDLERS
+    /* Failing here is not a failed request; the caller falls back */
+    pressure = take_pressure(m, 0, &need);
+    POSTACTION(m);
+    if (pressure)
+      (void)run_pressure_handler(m, need);
+#else /* USE_PRESSURE_HANDLERS */
+    POSTACTION(m);
+#endif /* USE_PRESSURE_HANDLERS */
+  }
+  return mem;
+}
+#endif /* USE_REALLOC_MMAP */
+
 static void* internal_memalign(mstate m, size_t alignment, size_t bytes) {
   void* mem = 0;
   if (alignment <  MIN_CHUNK_SIZE) /* must be at least a minimum chunk size */
@@ -5018,6 +8572,10 @@ static void** ialloc(mstate m,
   */
   was_enabled = use_mmap(m);
   disable_mmap(m);
+#if USE_SLABS
+  if (is_slab_request(size - CHUNK_OVERHEAD)) /* need a chunk to split */
+    size = SLAB_MAX_SIZE + CHUNK_OVERHEAD + 1;
+#endif /* USE_SLABS */
   mem = internal_malloc(m, size - CHUNK_OVERHEAD);
   if (was_enabled)
     enable_mmap(m);
@@ -5099,6 +8657,17 @@ static size_t internal_bulk_free(mstate m, void* array[], size_t nelem) {
       if (mem != 0) {
         mchunkptr p = mem2chunk(mem);
         size_t psize = chunksize(p);
+#if USE_SLABS
+        if (is_slab_mem(mem)) {
+          if (slab_of(mem)->owner != m)
+            ++unfreed;
+          else {
+            *a = 0;
+            slab_free(m, mem);
+          }
+          continue;
+        }
+#endif /* USE_SLABS */
 #if FOOTERS
         if (get_mstate_for(p) != m) {
           ++unfreed;
@@ -5126,11 +8695,57 @@ static size_t internal_bulk_free(mstate m, void* array[], size_t nelem) {
     }
     if (should_trim(m, m->topsize))
       sys_trim(m, 0);
-    POSTACTION(m);
+    FREE_POSTACTION(m);
   }
   return unfreed;
 }
 
+/*
+  Sort the pointers in array by address, so that internal_bulk_free
+  can coalesce whole runs of adjacent chunks before binning them. This
+  is an LSD radix sort on only those bytes in which the pointers
+  differ, using scratch space allocated from m. If that fails, the
+  array is left unsorted, which is still correct, just slower to free.
+*/
+static void sort_bulk_free_array(mstate m, void* array[], size_t nelem) {
+  void** tmp;
+  (void)m; /* placate people compiling -Wunused-parameter */
+  if (nelem > 1 &&
+      (tmp = (void**)internal_malloc(m, nelem * sizeof(void*))) != 0) {
+    void** src = array;
+    void** dst = tmp;
+    size_t first = (size_t)array[0];
+    size_t diff = 0;
+    size_t i, shift;
+    for (i = 1; i < nelem; ++i)
+      diff |= (size_t)array[i] ^ first;
+    for (shift = 0; shift < SIZE_T_BITSIZE && (diff >> shift) != 0;
+         shift += 8) {
+      if (((diff >> shift) & 0xffU) != 0) {
+        size_t count[256];
+        size_t sum = 0;
+        void** t;
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < nelem; ++i)
+          ++count[((size_t)src[i] >> shift) & 0xffU];
+        for (i = 0; i < 256; ++i) {
+          size_t c = count[i];
+          count[i] = sum;
+          sum += c;
+        }
+        for (i = 0; i < nelem; ++i)
+          dst[count[((size_t)src[i] >> shift) & 0xffU]++] = src[i];
+        t = src;
+        src = dst;
+        dst = t;
+      }
+    }
+    if (src != array)
+      memcpy(array, src, nelem * sizeof(void*));
+    internal_free(m, tmp);
+  }
+}
+
 /* Traversal */
 #if MALLOC_INSPECT_ALL
 static void internal_inspect_all(mstate m,
@@ -5190,6 +8805,11 @@ void* dlrealloc(void* oldmem, size_t bytes) {
     dlfree(oldmem);
   }
 #endif /* REALLOC_ZERO_BYTES_FREES */
+#if USE_SLABS
+  else if (is_slab_mem(oldmem)) {
+    mem = slab_realloc(oldmem, bytes);
+  }
+#endif /* USE_SLABS */
   else {
     size_t nb = request2size(bytes);
     mchunkptr oldp = mem2chunk(oldmem);
@@ -5210,7 +8830,11 @@ void* dlrealloc(void* oldmem, size_t bytes) {
         mem = chunk2mem(newp);
       }
       else {
-        mem = internal_malloc(m, bytes);
+#if USE_REALLOC_MMAP
+        mem = realloc_mmap_alloc(m, nb);
+#endif /* USE_REALLOC_MMAP */
+        if (mem == 0)
+          mem = internal_malloc(m, bytes);
         if (mem != 0) {
           size_t oc = chunksize(oldp) - overhead_for(oldp);
           memcpy(mem, oldmem, (oc < bytes)? oc : bytes);
@@ -5228,6 +8852,12 @@ void* dlrealloc_in_place(void* oldmem, size_t bytes) {
     if (bytes >= MAX_REQUEST) {
       MALLOC_FAILURE_ACTION;
     }
+#if USE_SLABS
+    else if (is_slab_mem(oldmem)) {
+      if (bytes <= slab_of(oldmem)->size)
+        mem = oldmem;
+    }
+#endif /* USE_SLABS */
     else {
       size_t nb = request2size(bytes);
       mchunkptr oldp = mem2chunk(oldmem);
@@ -5255,15 +8885,15 @@ void* dlrealloc_in_place(void* oldmem, size_t bytes) {
 
 void* dlmemalign(size_t alignment, size_t bytes) {
   if (alignment <= MALLOC_ALIGNMENT) {
-    return dlmalloc(bytes);
+    return dlmalloc(align_slab_request(bytes));
   }
-  return internal_memalign(gm, alignment, bytes);
+  return internal_memalign(thread_mstate(), alignment, bytes);
 }
 
 int dlposix_memalign(void** pp, size_t alignment, size_t bytes) {
   void* mem = 0;
   if (alignment == MALLOC_ALIGNMENT)
-    mem = dlmalloc(bytes);
+    mem = dlmalloc(align_slab_request(bytes));
   else {
     size_t d = alignment / sizeof(void*);
     size_t r = alignment % sizeof(void*);
@@ -5272,7 +8902,7 @@ int dlposix_memalign(void** pp, size_t alignment, size_t bytes) {
     else if (bytes <= MAX_REQUEST - alignment) {
       if (alignment <  MIN_CHUNK_SIZE)
         alignment = MIN_CHUNK_SIZE;
-      mem = internal_memalign(gm, alignment, bytes);
+      mem = internal_memalign(thread_mstate(), alignment, bytes);
     }
   }
   if (mem == 0)
@@ -5300,16 +8930,30 @@ void* dlpvalloc(size_t bytes) {
 void** dlindependent_calloc(size_t n_elements, size_t elem_size,
                             void* chunks[]) {
   size_t sz = elem_size; /* serves as 1-element array */
-  return ialloc(gm, n_elements, &sz, 3, chunks);
+  return ialloc(thread_mstate(), n_elements, &sz, 3, chunks);
 }
 
 void** dlindependent_comalloc(size_t n_elements, size_t sizes[],
                               void* chunks[]) {
-  return ialloc(gm, n_elements, sizes, 0, chunks);
+  return ialloc(thread_mstate(), n_elements, sizes, 0, chunks);
 }
 
 size_t dlbulk_free(void* array[], size_t nelem) {
+#if USE_ARENAS
+  /* Each pass frees the chunks belonging to one arena */
+  size_t unfreed = nelem, i;
+  for (i = 0; i < MAX_ARENAS && unfreed != 0; ++i)
+    if (arenas[i] != 0)
+      unfreed = internal_bulk_free(arenas[i], array, nelem);
+  return unfreed;
+#else /* USE_ARENAS */
   return internal_bulk_free(gm, array, nelem);
+#endif /* USE_ARENAS */
+}
+
+size_t dlbulk_free_sorted(void* array[], size_t nelem) {
+  sort_bulk_free_array(thread_mstate(), array, nelem);
+  return dlbulk_free(array, nelem);
 }
 
 #if MALLOC_INSPECT_ALL
@@ -5323,26 +8967,118 @@ void dlmalloc_inspect_all(void(*handler)(void *start,
     internal_inspect_all(gm, handler, arg);
     POSTACTION(gm);
   }
+#if USE_ARENAS
+  {
+    size_t i;
+    for (i = 1; i < MAX_ARENAS; ++i)
+      if (arenas[i] != 0 && !PREACTION(arenas[i])) {
+        internal_inspect_all(arenas[i], handler, arg);
+        POSTACTION(arenas[i]);
+      }
+  }
+#endif /* USE_ARENAS */
 }
 #endif /* MALLOC_INSPECT_ALL */
 
 int dlmalloc_trim(size_t pad) {
   int result = 0;
   ensure_initialization();
+#if USE_THREAD_CACHE
+  if (tcache.state > 0)
+    tcache_flush(&tcache);
+#endif /* USE_THREAD_CACHE */
+#if USE_PERCPU_CACHE
+  cpucache_flush_all();
+#endif /* USE_PERCPU_CACHE */
   if (!PREACTION(gm)) {
+#if USE_FASTBINS
+    consolidate_fast_chunks(gm);
+#endif /* USE_FASTBINS */
     result = sys_trim(gm, pad);
+#if USE_MMAP_CACHE
+    if (mmap_cache_flush(gm) != 0)
+      result = 1;
+#endif /* USE_MMAP_CACHE */
+#if USE_PAGE_PURGING
+    if (purge_free_chunks(gm) != 0)
+      result = 1;
+#endif /* USE_PAGE_PURGING */
     POSTACTION(gm);
   }
+#if USE_ARENAS
+  {
+    size_t i;
+    for (i = 1; i < MAX_ARENAS; ++i)
+      if (arenas[i] != 0 && mspace_trim(arenas[i], pad))
+        result = 1;
+  }
+#endif /* USE_ARENAS */
   return result;
 }
 
+#if USE_BACKGROUND_PURGE
+int dlmalloc_background_purge(int enable) {
+  return set_background_purge(gm, enable);
+}
+#endif /* USE_BACKGROUND_PURGE */
+
 size_t dlmalloc_footprint(void) {
+#if USE_ARENAS
+  size_t result = 0, i;
+  for (i = 0; i < MAX_ARENAS; ++i)
+    if (arenas[i] != 0)
+      result += arenas[i]->footprint;
+  return result;
+#else /* USE_ARENAS */
   return gm->footprint;
+#endif /* USE_ARENAS */
 }
 
 size_t dlmalloc_max_footprint(void) {
+#if USE_ARENAS
+  size_t result = 0, i;
+  for (i = 0; i < MAX_ARENAS; ++i)
+    if (arenas[i] != 0)
+      result += arenas[i]->max_footprint;
+  return result;
+#else /* USE_ARENAS */
   return gm->max_footprint;
+#endif /* USE_ARENAS */
+}
+
+#if USE_NUMA
+size_t dlmalloc_node_footprint(int node) {
+  size_t result = 0;
+#if USE_ARENAS
+  size_t i;
+  for (i = 0; i < MAX_ARENAS; ++i)
+    if (arenas[i] != 0 && arenas[i]->numa_node == node)
+      result += arenas[i]->footprint;
+#else /* USE_ARENAS */
+  if (gm->numa_node == node)
+    result = gm->footprint;
+#endif /* USE_ARENAS */
+  return result;
+}
+#endif /* USE_NUMA */
+
+#if USE_RESIDENT_BYTES
+size_t dlmalloc_resident_bytes(void) {
+  size_t result = 0;
+  ensure_initialization();
+#if USE_ARENAS
+  {
+    size_t i;
+    for (i = 0; i < MAX_ARENAS; ++i)
+      if (arenas[i] != 0)
+        result += resident_bytes(arenas[i]);
+  }
+#else /* USE_ARENAS */
+  result = resident_bytes(gm);
+#endif /* USE_ARENAS */
+  return result;
 }
+#endif /* USE_RESIDENT_BYTES */
 
 size_t dlmalloc_footprint_limit(void) {
   size_t maf = gm->footprint_limit;
@@ -5357,18 +9093,75 @@ size_t dlmalloc_set_footprint_limit(size_t bytes) {
     result = 0;                    /* disable */
   else
     result = granularity_align(bytes);
+#if USE_ARENAS
+  {
+    size_t i;
+    for (i = 1; i < MAX_ARENAS; ++i)
+      if (arenas[i] != 0)
+        arenas[i]->footprint_limit = result;
+  }
+#endif /* USE_ARENAS */
   return gm->footprint_limit = result;
 }
 
+#if USE_PRESSURE_HANDLERS
+void dlmalloc_set_pressure_handler(int (*handler)(void*, size_t, void*),
+                                   void* arg, size_t permille) {
+  ensure_initialization();
+  if (!PREACTION(gm)) {
+    set_pressure_handler(gm, handler, arg, permille);
+    POSTACTION(gm);
+  }
+#if USE_ARENAS
+  {
+    size_t i;
+    for (i = 1; i < MAX_ARENAS; ++i) {
+      mstate m = arenas[i];
+      if (m != 0 && !PREACTION(m)) {
+        set_pressure_handler(m, handler, arg, permille);
+        POSTACTION(m);
+      }
+    }
+  }
+#endif /* USE_ARENAS */
+}
+#endif /* USE_PRESSURE_HANDLERS */
+
 #if !NO_MALLINFO
 struct mallinfo dlmallinfo(void) {
+#if USE_ARENAS
+  struct mallinfo nm = internal_mallinfo(gm);
+  size_t i;
+  for (i = 1; i < MAX_ARENAS; ++i) {
+    if (arenas[i] != 0) {
+      struct mallinfo am = internal_mallinfo(arenas[i]);
+      nm.arena    += am.arena;
+      nm.ordblks  += am.ordblks;
+      nm.hblkhd   += am.hblkhd;
+      nm.usmblks  += am.usmblks;
+      nm.uordblks += am.uordblks;
+      nm.fordblks += am.fordblks;
+      nm.keepcost += am.keepcost;
+    }
+  }
+  return nm;
+#else /* USE_ARENAS */
   return internal_mallinfo(gm);
+#endif /* USE_ARENAS */
 }
 #endif /* NO_MALLINFO */
 
 #if !NO_MALLOC_STATS
 void dlmalloc_stats() {
   internal_malloc_stats(gm);
+#if USE_ARENAS
+  {
+    size_t i;
+    for (i = 1; i < MAX_ARENAS; ++i)
+      if (arenas[i] != 0)
+        internal_malloc_stats(arenas[i]);
+  }
+#endif /* USE_ARENAS */
 }
 #endif /* NO_MALLOC_STATS */
 
@@ -5377,6 +9170,10 @@ int dlmallopt(int param_number, int value) {
 }
 
 size_t dlmalloc_usable_size(void* mem) {
+#if USE_SLABS
+  if (is_slab_mem(mem))
+    return slab_of(mem)->size;
+#endif /* USE_SLABS */
   if (mem != 0) {
     mchunkptr p = mem2chunk(mem);
     if (is_inuse(p))
@@ -5406,6 +9203,12 @@ static mstate init_user_mstate(char* tbase, size_t tsize) {
   m->mflags = mparams.default_mflags;
   m->extp = 0;
   m->exts = 0;
+#if USE_NUMA
+  m->numa_node = -1;
+#endif /* USE_NUMA */
+#if USE_REMOTE_FREES
+  m->owner = CURRENT_THREAD;
+#endif /* USE_REMOTE_FREES */
   disable_contiguous(m);
   init_bins(m);
   mn = next_chunk(mem2chunk(m));
@@ -5414,7 +9217,15 @@ static mstate init_user_mstate(char* tbase, size_t tsize) {
   return m;
 }
 
+#if USE_NUMA
+mspace create_mspace(size_t capacity, int locked) {
+  return create_mspace_on_node(capacity, locked, -1);
+}
+
+mspace create_mspace_on_node(size_t capacity, int locked, int node) {
+#else /* USE_NUMA */
 mspace create_mspace(size_t capacity, int locked) {
+#endif /* USE_NUMA */
   mstate m = 0;
   size_t msize;
   ensure_initialization();
@@ -5423,15 +9234,244 @@ mspace create_mspace(size_t capacity, int locked) {
     size_t rs = ((capacity == 0)? mparams.granularity :
                  (capacity + TOP_FOOT_SIZE + msize));
     size_t tsize = granularity_align(rs);
-    char* tbase = (char*)(CALL_MMAP(tsize));
+    char* tbase = (char*)(CALL_SEGMENT_MMAP(tsize));
     if (tbase != CMFAIL) {
+#if USE_NUMA
+      numa_bind(tbase, tsize, node);
+#endif /* USE_NUMA */
       m = init_user_mstate(tbase, tsize);
+#if USE_NUMA
+      m->numa_node = (node >= 0)? node : -1;
+#endif /* USE_NUMA */
       m->seg.sflags = USE_MMAP_BIT;
       set_lock(m, locked);
+#if USE_REMOTE_FREES
+      if (!locked)
+        m->mflags |= REMOTE_FREE_BIT;
+#endif /* USE_REMOTE_FREES */
+    }
+  }
+  return (mspace)m;
+}
+
+#if USE_FILE_MSPACES
+/*
+  A file mspace starts with this header, followed by the malloc_state
+  and its single segment, which has FILE_BIT and EXTERN_BIT set. The
+  space has NO_GROW_BIT set, so m->seg stays the file segment. The
+  page-aligned file base is also aligned for chunks, so the
+  malloc_state directly follows the header, which file_header finds.
+*/
+struct malloc_file_header {
+  size_t     magic;       /* FILE_MSPACE_MAGIC */
+  size_t     version;     /* DLMALLOC_VERSION */
+  size_t     config;      /* FILE_MSPACE_CONFIG */
+  char*      base;        /* address the file is mapped at */
+  size_t     size;        /* size of the file */
+  size_t     foot_magic;  /* mparams.magic that footers were made with */
+  size_t     clean;       /* nonzero if closed by close_mspace_file */
+};
+
+#define FILE_MSPACE_MAGIC   ((size_t)0x646c6d73U)
+/* Layout-affecting settings that must match when a file is reopened */
+#define FILE_MSPACE_CONFIG  ((sizeof(struct malloc_state) << 4) |\
+                             (MALLOC_ALIGNMENT << 1) | (FOOTERS != 0))
+#define FILE_HEADER_SIZE\
+  ((sizeof(struct malloc_file_header) + CHUNK_ALIGN_MASK) & ~CHUNK_ALIGN_MASK)
+#define file_header(M)\
+  ((struct malloc_file_header*)((char*)mem2chunk(M) - FILE_HEADER_SIZE))
+
+#ifdef MAP_FIXED_NOREPLACE
+#define FILE_MAP_FLAGS      (MAP_SHARED|MAP_FIXED_NOREPLACE)
+#else /* MAP_FIXED_NOREPLACE */
+#define FILE_MAP_FLAGS      (MAP_SHARED) /* treated as a hint */
+#endif /* MAP_FIXED_NOREPLACE */
+
+mspace create_mspace_with_file(const char* path, size_t capacity,
+                               int locked) {
+  mstate m = 0;
+  int fd;
+  ensure_initialization();
+  if (capacity >= (size_t) -(mparams.page_size))
+    return 0;
+  capacity = page_align(capacity);
+  if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0666)) < 0)
+    return 0;
+  if (capacity > FILE_HEADER_SIZE && ftruncate(fd, (off_t)capacity) == 0) {
+    char* base = (char*)mmap(0, capacity, MMAP_PROT, MAP_SHARED, fd, 0);
+    if (base != CMFAIL) {
+      m = (mstate)create_mspace_with_base(base + FILE_HEADER_SIZE,
+                                          capacity - FILE_HEADER_SIZE, locked);
+      if (m != 0) {
+        struct malloc_file_header* h = (struct malloc_file_header*)base;
+        m->seg.sflags |= FILE_BIT;
+        m->mflags |= NO_GROW_BIT;
+        disable_mmap(m);
+        m->footprint_limit = m->footprint;
+        h->magic = FILE_MSPACE_MAGIC;
+        h->version = DLMALLOC_VERSION;
+        h->config = FILE_MSPACE_CONFIG;
+        h->base = base;
+        h->size = capacity;
+        h->foot_magic = mparams.magic;
+        h->clean = 0;
+      }
+      else
+        (void)munmap(base, capacity);
+    }
+  }
+  (void)close(fd);
+  return (mspace)m;
+}
+
+mspace open_mspace_file(const char* path) {
+  mstate m = 0;
+  struct malloc_file_header h;
+  struct stat st;
+  int fd;
+  ensure_initialization();
+  if ((fd = open(path, O_RDWR)) < 0)
+    return 0;
+  if (pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+      fstat(fd, &st) == 0 &&
+      h.magic == FILE_MSPACE_MAGIC &&
+      h.version == DLMALLOC_VERSION &&
+      h.config == FILE_MSPACE_CONFIG &&
+      h.clean != 0 &&
+      is_page_aligned(h.base) &&
+      h.size > FILE_HEADER_SIZE &&
+      (size_t)st.st_size == h.size) {
+    char* base = (char*)mmap(h.base, h.size, MMAP_PROT, FILE_MAP_FLAGS, fd, 0);
+    if (base == h.base) {
+      struct malloc_file_header* fh = (struct malloc_file_header*)base;
+      m = (mstate)(chunk2mem(align_as_chunk(base + FILE_HEADER_SIZE)));
+      (void)INITIAL_LOCK(&m->mutex);
+      m->magic = mparams.magic;
+      m->mflags &= ~(ORPHAN_BIT | PURGE_BIT);
+#if USE_REMOTE_FREES
+      m->owner = CURRENT_THREAD;
+      m->remote_frees = 0;
+#endif /* USE_REMOTE_FREES */
+#if USE_PRESSURE_HANDLERS
+      m->pressure_handler = 0; /* pointers from an earlier run */
+      m->pressure_arg = 0;
+      m->pressure_need = 0;
+      m->pressure_mark = 0;
+#endif /* USE_PRESSURE_HANDLERS */
+#if FOOTERS
+      if (fh->foot_magic != mparams.magic) { /* rewrite footers */
+        mchunkptr q = align_as_chunk(m->seg.base);
+        while (q != m->top && q->head != FENCEPOST_HEAD) {
+          if (is_inuse(q))
+            mark_inuse_foot(m, q, chunksize(q));
+          q = next_chunk(q);
+        }
+        fh->foot_magic = mparams.magic;
+      }
+#endif /* FOOTERS */
+      fh->clean = 0;
+      check_malloc_state(m);
+    }
+    else if (base != CMFAIL)
+      (void)munmap(base, h.size);
+  }
+  (void)close(fd);
+  return (mspace)m;
+}
+
+int close_mspace_file(mspace msp) {
+  int ret = -1;
+  mstate ms = (mstate)msp;
+  if (!ok_magic(ms) || !(ms->mflags & NO_GROW_BIT) ||
+      !(ms->seg.sflags & FILE_BIT)) {
+    USAGE_ERROR_ACTION(ms,ms);
+    return -1;
+  }
+#if USE_BACKGROUND_PURGE
+  if (ms->mflags & PURGE_BIT)
+    set_background_purge(ms, 0);
+#endif /* USE_BACKGROUND_PURGE */
+  if (!PREACTION(ms)) {
+    struct malloc_file_header* h = file_header(ms);
+    char* base = h->base;
+    size_t size = h->size;
+#if USE_REMOTE_FREES
+    if (ms->mflags & REMOTE_FREE_BIT)
+      release_remote_frees(ms);
+#endif /* USE_REMOTE_FREES */
+    /* Write back the space before marking it clean */
+    if (msync(base, size, MS_SYNC) == 0) {
+      h->clean = 1;
+      if (msync(base, mparams.page_size, MS_SYNC) == 0)
+        ret = 0;
+    }
+    POSTACTION(ms);
+    (void)DESTROY_LOCK(&ms->mutex);
+    (void)munmap(base, size);
+  }
+  return ret;
+}
+#endif /* USE_FILE_MSPACES */
+
+#if USE_SHARED_MSPACES
+mspace create_shared_mspace(void* base, size_t capacity) {
+  mstate m = (mstate)create_mspace_with_base(base, capacity, 1);
+  if (m != 0) {
+    (void)DESTROY_LOCK(&m->mutex);
+    if (INITIAL_SHARED_LOCK(&m->mutex) != 0)
+      return 0;
+    m->magic = SHARED_MSPACE_MAGIC;
+    m->mflags |= SHARED_BIT | NO_GROW_BIT; /* memory must stay shared */
+    disable_mmap(m);
+    m->footprint_limit = m->footprint;
+  }
+  return (mspace)m;
+}
+
+mspace attach_shared_mspace(void* base) {
+  mstate m = (mstate)(chunk2mem(align_as_chunk((char*)base)));
+  ensure_initialization(); /* the attacher may not have used malloc yet */
+  if (m->magic == SHARED_MSPACE_MAGIC && (m->mflags & SHARED_BIT) &&
+      m->seg.base == (char*)base)
+    return (mspace)m;
+  return 0;
+}
+#endif /* USE_SHARED_MSPACES */
+
+#if USE_RESERVED_MSPACES
+mspace create_mspace_reserved(size_t reserve, size_t capacity, int locked) {
+  mstate m = 0;
+  size_t msize;
+  ensure_initialization();
+  msize = pad_request(sizeof(struct malloc_state));
+  if (capacity < (size_t) -(msize + TOP_FOOT_SIZE + mparams.page_size) &&
+      reserve < (size_t) -(mparams.granularity)) {
+    size_t rs = ((capacity == 0)? mparams.granularity :
+                 (capacity + TOP_FOOT_SIZE + msize));
+    size_t tsize = granularity_align(rs);
+    size_t rsize = granularity_align(reserve);
+    char* tbase;
+    if (rsize < tsize)
+      rsize = tsize;
+    tbase = reserve_mmap(rsize);
+    if (tbase != CMFAIL) {
+      if (commit_reserved(tbase, tsize) == 0) {
+        m = init_user_mstate(tbase, tsize);
+        m->seg.sflags = RESERVED_BIT;
+        m->reserve_end = tbase + rsize;
+        set_lock(m, locked);
+#if USE_REMOTE_FREES
+        if (!locked)
+          m->mflags |= REMOTE_FREE_BIT;
+#endif /* USE_REMOTE_FREES */
+      }
+      else
+        (void)CALL_MUNMAP(tbase, rsize);
     }
   }
   return (mspace)m;
 }
+#endif /* USE_RESERVED_MSPACES */
 
 mspace create_mspace_with_base(void* base, size_t capacity, int locked) {
   mstate m = 0;
@@ -5443,6 +9483,10 @@ mspace create_mspace_with_base(void* base, size_t capacity, int locked) {
     m = init_user_mstate((char*)base, capacity);
     m->seg.sflags = EXTERN_BIT;
     set_lock(m, locked);
+#if USE_REMOTE_FREES
+    if (!locked)
+      m->mflags |= REMOTE_FREE_BIT;
+#endif /* USE_REMOTE_FREES */
   }
   return (mspace)m;
 }
@@ -5455,7 +9499,8 @@ int mspace_track_large_chunks(mspace msp, int enable) {
       ret = 1;
     }
     if (!enable) {
-      enable_mmap(ms);
+      if (!(ms->mflags & NO_GROW_BIT))
+        enable_mmap(ms);
     } else {
       disable_mmap(ms);
     }
@@ -5464,11 +9509,97 @@ int mspace_track_large_chunks(mspace msp, int enable) {
   return ret;
 }
 
+#if USE_BACKGROUND_PURGE
+int mspace_background_purge(mspace msp, int enable) {
+  mstate ms = (mstate)msp;
+  if (!ok_magic(ms)) {
+    USAGE_ERROR_ACTION(ms,ms);
+    return 0;
+  }
+  return set_background_purge(ms, enable);
+}
+#endif /* USE_BACKGROUND_PURGE */
+
+#if USE_PREFAULT_MSPACES
+int mspace_prefault(mspace msp, int flags) {
+  int ret = 0;
+  mstate ms = (mstate)msp;
+  if (!ok_magic(ms)) {
+    USAGE_ERROR_ACTION(ms,ms);
+    return ret;
+  }
+  if (!PREACTION(ms)) {
+    msegmentptr sp = &ms->seg;
+    ret = ((ms->mflags & PREFAULT_BIT)? MSPACE_PREFAULT : 0) |
+      ((ms->mflags & MLOCK_BIT)? MSPACE_MLOCK : 0);
+    ms->mflags &= ~(PREFAULT_BIT | MLOCK_BIT);
+    if (flags & MSPACE_PREFAULT)
+      ms->mflags |= PREFAULT_BIT;
+    if (flags & MSPACE_MLOCK)
+      ms->mflags |= MLOCK_BIT;
+    for (; sp != 0; sp = sp->next) {
+      if (is_extern_segment(sp))
+        continue;
+      if ((flags & MSPACE_MLOCK) && !is_locked_segment(sp)) {
+        if (mlock(sp->base, sp->size) == 0)
+          sp->sflags |= LOCKED_BIT;
+      }
+      else if (!(flags & MSPACE_MLOCK) && is_locked_segment(sp)) {
+        (void)munlock(sp->base, sp->size);
+        sp->sflags &= ~LOCKED_BIT;
+      }
+    }
+    if (prefaults(ms) && ms->top != 0)
+      populate_pages((char*)ms->top, ms->topsize);
+    POSTACTION(ms);
+  }
+  return ret;
+}
+
+size_t mspace_locked_footprint(mspace msp) {
+  size_t result = 0;
+  mstate ms = (mstate)msp;
+  if (!ok_magic(ms)) {
+    USAGE_ERROR_ACTION(ms,ms);
+  }
+  else if (!PREACTION(ms)) {
+    msegmentptr sp = &ms->seg;
+    for (; sp != 0; sp = sp->next)
+      if (is_locked_segment(sp))
+        result += sp->size;
+    POSTACTION(ms);
+  }
+  return result;
+}
+#endif /* USE_PREFAULT_MSPACES */
+
 size_t destroy_mspace(mspace msp) {
   size_t freed = 0;
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
     msegmentptr sp = &ms->seg;
+#if USE_RESERVED_MSPACES
+    char* reserve_end = ms->reserve_end; /* read before unmapped */
+#endif /* USE_RESERVED_MSPACES */
+#if USE_FILE_MSPACES
+    struct malloc_file_header* fh = (ms->seg.sflags & FILE_BIT)?
+      file_header(ms) : 0;
+    char* fbase = (fh != 0)? fh->base : 0;
+    size_t fsize = (fh != 0)? fh->size : 0;
+#endif /* USE_FILE_MSPACES */
+#if USE_BACKGROUND_PURGE
+    if (ms->mflags & PURGE_BIT)
+      set_background_purge(ms, 0);
+#endif /* USE_BACKGROUND_PURGE */
+#if USE_SLABS
+    release_slabs(ms);
+#endif /* USE_SLABS */
+#if USE_MMAP_CACHE
+    freed += mmap_cache_flush(ms);
+#endif /* USE_MMAP_CACHE */
+#if USE_SEGMENT_INDEX
+    segindex_free(ms);
+#endif /* USE_SEGMENT_INDEX */
     (void)DESTROY_LOCK(&ms->mutex); /* destroy before unmapped */
     while (sp != 0) {
       char* base = sp->base;
@@ -5476,10 +9607,21 @@ size_t destroy_mspace(mspace msp) {
       flag_t flag = sp->sflags;
       (void)base; /* placate people compiling -Wunused-variable */
       sp = sp->next;
+#if USE_RESERVED_MSPACES
+      if (flag & RESERVED_BIT) {
+        if (CALL_MUNMAP(base, (size_t)(reserve_end - base)) == 0)
+          freed += size;
+      }
+      else
+#endif /* USE_RESERVED_MSPACES */
       if ((flag & USE_MMAP_BIT) && !(flag & EXTERN_BIT) &&
           CALL_MUNMAP(base, size) == 0)
         freed += size;
     }
+#if USE_FILE_MSPACES
+    if (fbase != 0 && munmap(fbase, fsize) == 0)
+      freed += fsize;
+#endif /* USE_FILE_MSPACES */
   }
   else {
     USAGE_ERROR_ACTION(ms,ms);
@@ -5487,126 +9629,344 @@ size_t destroy_mspace(mspace msp) {
   return freed;
 }
 
+#if USE_THREAD_MSPACES
+mspace thread_mspace(void) {
+  mstate ms = thread_ms;
+  if (ms == 0) {
+    ensure_initialization();
+    if (!thread_ms_key_ok)
+      return 0;
+    ACQUIRE_MALLOC_GLOBAL_LOCK();
+    if ((ms = orphans) != 0)
+      orphans = ms->next_orphan;
+    RELEASE_MALLOC_GLOBAL_LOCK();
+    if (ms != 0) { /* adopt */
+      if (!PREACTION(ms)) {
+        ms->mflags &= ~ORPHAN_BIT;
+        POSTACTION(ms);
+      }
+    }
+    else if ((ms = (mstate)create_mspace(0, 1)) == 0)
+      return 0;
+    else {
+      ACQUIRE_LOCK(&thread_ms_mutex);
+      ms->next_thread = thread_spaces;
+      thread_spaces = ms;
+      RELEASE_LOCK(&thread_ms_mutex);
+    }
+    if (pthread_setspecific(thread_ms_key, ms) != 0) {
+      orphan_mspace(ms);
+      return 0;
+    }
+    thread_ms = ms;
+  }
+  return (mspace)ms;
+}
+#endif /* USE_THREAD_MSPACES */
+
 /*
   mspace versions of routines are near-clones of the global
   versions. This is not so nice but better than the alternatives.
 */
 
-void* mspace_malloc(mspace msp, size_t bytes) {
-  mstate ms = (mstate)msp;
-  if (!ok_magic(ms)) {
-    USAGE_ERROR_ACTION(ms,ms);
-    return 0;
-  }
-  if (!PREACTION(ms)) {
-    void* mem;
-    size_t nb;
-    if (bytes <= MAX_SMALL_REQUEST) {
-      bindex_t idx;
-      binmap_t smallbits;
-      nb = (bytes < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(bytes);
-      idx = small_index(nb);
-      smallbits = ms->smallmap >> idx;
-
-      if ((smallbits & 0x3U) != 0) { /* Remainderless fit to a smallbin. */
-        mchunkptr b, p;
-        idx += ~smallbits & 1;       /* Uses next bin if idx empty */
-        b = smallbin_at(ms, idx);
+/*
+  The allocation algorithm of mspace_malloc, called with ms locked
+  (if ms uses locks). See dlmalloc for an outline.
+*/
+static void* mspace_malloc_locked(mstate ms, size_t bytes) {
+  void* mem;
+  size_t nb;
+#if USE_SLABS
+  if (is_slab_request(bytes) && (mem = slab_alloc(ms, bytes)) != 0)
+    return mem;
+#endif /* USE_SLABS */
+  if (bytes <= MAX_SMALL_REQUEST) {
+    bindex_t idx;
+    binmap_t smallbits;
+    nb = (bytes < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(bytes);
+    idx = small_index(nb);
+#if USE_FASTBINS
+    if (nb <= MAX_FAST_CHUNK && fastmap_is_marked(ms, idx)) {
+      mchunkptr p;
+      unlink_first_fast_chunk(ms, p, idx);
+      mem = chunk2mem(p);
+      check_malloced_chunk(ms, mem, nb);
+      return mem;
+    }
+#endif /* USE_FASTBINS */
+    smallbits = ms->smallmap >> idx;
+
+    if ((smallbits & 0x3U) != 0) { /* Remainderless fit to a smallbin. */
+      mchunkptr b, p;
+      idx += ~smallbits & 1;       /* Uses next bin if idx empty */
+      b = smallbin_at(ms, idx);
+      p = b->fd;
+      assert(chunksize(p) == small_index2size(idx));
+      unlink_first_small_chunk(ms, b, p, idx);
+      set_inuse_and_pinuse(ms, p, small_index2size(idx));
+      mem = chunk2mem(p);
+      check_malloced_chunk(ms, mem, nb);
+      return mem;
+    }
+
+    else if (nb > ms->dvsize) {
+      if (smallbits != 0) { /* Use chunk in next nonempty smallbin */
+        mchunkptr b, p, r;
+        size_t rsize;
+        bindex_t i;
+        binmap_t leftbits = (smallbits << idx) & left_bits(idx2bit(idx));
+        binmap_t leastbit = least_bit(leftbits);
+        compute_bit2idx(leastbit, i);
+        b = smallbin_at(ms, i);
         p = b->fd;
-        assert(chunksize(p) == small_index2size(idx));
-        unlink_first_small_chunk(ms, b, p, idx);
-        set_inuse_and_pinuse(ms, p, small_index2size(idx));
+        assert(chunksize(p) == small_index2size(i));
+        unlink_first_small_chunk(ms, b, p, i);
+        rsize = small_index2size(i) - nb;
+        /* Fit here cannot be remainderless if 4byte sizes */
+        if (SIZE_T_SIZE != 4 && rsize < MIN_CHUNK_SIZE)
+          set_inuse_and_pinuse(ms, p, small_index2size(i));
+        else {
+          set_size_and_pinuse_of_inuse_chunk(ms, p, nb);
+          r = chunk_plus_offset(p, nb);
+          set_size_and_pinuse_of_free_chunk(r, rsize);
+          replace_dv(ms, r, rsize);
+        }
         mem = chunk2mem(p);
         check_malloced_chunk(ms, mem, nb);
-        goto postaction;
+        return mem;
       }
 
-      else if (nb > ms->dvsize) {
-        if (smallbits != 0) { /* Use chunk in next nonempty smallbin */
-          mchunkptr b, p, r;
-          size_t rsize;
-          bindex_t i;
-          binmap_t leftbits = (smallbits << idx) & left_bits(idx2bit(idx));
-          binmap_t leastbit = least_bit(leftbits);
-          compute_bit2idx(leastbit, i);
-          b = smallbin_at(ms, i);
-          p = b->fd;
-          assert(chunksize(p) == small_index2size(i));
-          unlink_first_small_chunk(ms, b, p, i);
-          rsize = small_index2size(i) - nb;
-          /* Fit here cannot be remainderless if 4byte sizes */
-          if (SIZE_T_SIZE != 4 && rsize < MIN_CHUNK_SIZE)
-            set_inuse_and_pinuse(ms, p, small_index2size(i));
-          else {
-            set_size_and_pinuse_of_inuse_chunk(ms, p, nb);
-            r = chunk_plus_offset(p, nb);
-            set_size_and_pinuse_of_free_chunk(r, rsize);
-            replace_dv(ms, r, rsize);
-          }
-          mem = chunk2mem(p);
-          check_malloced_chunk(ms, mem, nb);
-          goto postaction;
-        }
-
-        else if (ms->treemap != 0 && (mem = tmalloc_small(ms, nb)) != 0) {
-          check_malloced_chunk(ms, mem, nb);
-          goto postaction;
-        }
-      }
-    }
-    else if (bytes >= MAX_REQUEST)
-      nb = MAX_SIZE_T; /* Too big to allocate. Force failure (in sys alloc) */
-    else {
-      nb = pad_request(bytes);
-      if (ms->treemap != 0 && (mem = tmalloc_large(ms, nb)) != 0) {
+      else if (ms->treemap != 0 && (mem = tmalloc_small(ms, nb)) != 0) {
         check_malloced_chunk(ms, mem, nb);
-        goto postaction;
+        return mem;
       }
     }
-
-    if (nb <= ms->dvsize) {
-      size_t rsize = ms->dvsize - nb;
-      mchunkptr p = ms->dv;
-      if (rsize >= MIN_CHUNK_SIZE) { /* split dv */
-        mchunkptr r = ms->dv = chunk_plus_offset(p, nb);
-        ms->dvsize = rsize;
-        set_size_and_pinuse_of_free_chunk(r, rsize);
-        set_size_and_pinuse_of_inuse_chunk(ms, p, nb);
-      }
-      else { /* exhaust dv */
-        size_t dvs = ms->dvsize;
-        ms->dvsize = 0;
-        ms->dv = 0;
-        set_inuse_and_pinuse(ms, p, dvs);
-      }
-      mem = chunk2mem(p);
+  }
+  else if (bytes >= MAX_REQUEST)
+    nb = MAX_SIZE_T; /* Too big to allocate. Force failure (in sys alloc) */
+  else {
+    nb = pad_request(bytes);
+#if USE_FASTBINS
+    if (ms->fastmap != 0)
+      consolidate_fast_chunks(ms);
+#endif /* USE_FASTBINS */
+    if (ms->treemap != 0 && (mem = tmalloc_large(ms, nb)) != 0) {
       check_malloced_chunk(ms, mem, nb);
-      goto postaction;
+      return mem;
     }
+  }
 
-    else if (nb < ms->topsize) { /* Split top */
-      size_t rsize = ms->topsize -= nb;
-      mchunkptr p = ms->top;
-      mchunkptr r = ms->top = chunk_plus_offset(p, nb);
-      r->head = rsize | PINUSE_BIT;
+  if (nb <= ms->dvsize) {
+    size_t rsize = ms->dvsize - nb;
+    mchunkptr p = ms->dv;
+    if (rsize >= MIN_CHUNK_SIZE) { /* split dv */
+      mchunkptr r = ms->dv = chunk_plus_offset(p, nb);
+      ms->dvsize = rsize;
+      set_size_and_pinuse_of_free_chunk(r, rsize);
       set_size_and_pinuse_of_inuse_chunk(ms, p, nb);
-      mem = chunk2mem(p);
-      check_top_chunk(ms, ms->top);
-      check_malloced_chunk(ms, mem, nb);
-      goto postaction;
     }
+    else { /* exhaust dv */
+      size_t dvs = ms->dvsize;
+      ms->dvsize = 0;
+      ms->dv = 0;
+      set_inuse_and_pinuse(ms, p, dvs);
+    }
+    mem = chunk2mem(p);
+    check_malloced_chunk(ms, mem, nb);
+    return mem;
+  }
+
+  else if (nb < ms->topsize) { /* Split top */
+    size_t rsize = ms->topsize -= nb;
+    mchunkptr p = ms->top;
+    mchunkptr r = ms->top = chunk_plus_offset(p, nb);
+    r->head = rsize | PINUSE_BIT;
+    set_size_and_pinuse_of_inuse_chunk(ms, p, nb);
+    mem = chunk2mem(p);
+    check_top_chunk(ms, ms->top);
+    check_malloced_chunk(ms, mem, nb);
+    return mem;
+  }
 
-    mem = sys_alloc(ms, nb);
+#if USE_FASTBINS
+  if (ms->fastmap != 0) { /* retry after consolidating */
+    consolidate_fast_chunks(ms);
+    return mspace_malloc_locked(ms, bytes);
+  }
+#endif /* USE_FASTBINS */
+  return sys_alloc(ms, nb);
+}
 
-  postaction:
+void* mspace_malloc(mspace msp, size_t bytes) {
+  mstate ms = (mstate)msp;
+  if (!ok_magic(ms)) {
+    USAGE_ERROR_ACTION(ms,ms);
+    return 0;
+  }
+  if (!PREACTION(ms)) {
+    void* mem;
+#if USE_PRESSURE_HANDLERS
+    size_t need;
+    int pressure;
+#endif /* USE_PRESSURE_HANDLERS */
+#if USE_REMOTE_FREES
+    if (ms->mflags & REMOTE_FREE_BIT)
+      release_remote_frees(ms);
+#endif /* USE_REMOTE_FREES */
+    mem = mspace_malloc_locked(ms, bytes);
+#if USE_PRESSURE_HANDLERS
+    pressure = take_pressure(ms, mem == 0, &need);
+    POSTACTION(ms);
+    if (pressure)
+      mem = relieve_pressure(ms, mem, bytes, need);
+#else /* USE_PRESSURE_HANDLERS */
     POSTACTION(ms);
+#endif /* USE_PRESSURE_HANDLERS */
     return mem;
   }
-
   return 0;
 }
 
+size_t mspace_malloc_batch(mspace msp, size_t bytes, size_t n, void** out) {
+  mstate ms = (mstate)msp;
+  size_t count = 0;
+  if (!ok_magic(ms)) {
+    USAGE_ERROR_ACTION(ms,ms);
+    return 0;
+  }
+  if (!PREACTION(ms)) {
+#if USE_PRESSURE_HANDLERS
+    size_t need;
+    int pressure;
+#endif /* USE_PRESSURE_HANDLERS */
+#if USE_REMOTE_FREES
+    if (ms->mflags & REMOTE_FREE_BIT)
+      release_remote_frees(ms);
+#endif /* USE_REMOTE_FREES */
+    if (bytes <= MAX_SMALL_REQUEST && !is_slab_request(bytes)) {
+      size_t nb = (bytes < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(bytes);
+      count = carve_small_chunks(ms, nb, out, n);
+    }
+    while (count < n && (out[count] = mspace_malloc_locked(ms, bytes)) != 0)
+      ++count;
+#if USE_PRESSURE_HANDLERS
+    pressure = take_pressure(ms, count < n, &need);
+    POSTACTION(ms);
+    if (pressure) /* a short batch is not retried */
+      (void)run_pressure_handler(ms, need);
+#else /* USE_PRESSURE_HANDLERS */
+    POSTACTION(ms);
+#endif /* USE_PRESSURE_HANDLERS */
+  }
+  return count;
+}
+
+#if USE_ARENAS
+
+/* Return arena i, creating it if necessary; 0 if it cannot be created */
+static mstate arena_at(size_t i) {
+  mstate m = arenas[i];
+  if (m == 0) {
+    ACQUIRE_MALLOC_GLOBAL_LOCK();
+#if USE_NUMA
+    if ((m = arenas[i]) == 0 &&
+        (m = (mstate)create_mspace_on_node(0, 1, (int)i)) != 0) {
+#else /* USE_NUMA */
+    if ((m = arenas[i]) == 0 && (m = (mstate)create_mspace(0, 1)) != 0) {
+#endif /* USE_NUMA */
+      m->footprint_limit = gm->footprint_limit;
+#if USE_PRESSURE_HANDLERS
+      set_pressure_handler(m, gm->pressure_handler, gm->pressure_arg,
+                           gm->pressure_step);
+#endif /* USE_PRESSURE_HANDLERS */
+      arenas[i] = m;
+    }
+    RELEASE_MALLOC_GLOBAL_LOCK();
+  }
+  return m;
+}
+
+/* Return the calling thread's arena index, assigning one if needed */
+static size_t arena_index(void) {
+  size_t n = mparams.narenas;
+  size_t i = thread_arena;
+  if (i == 0 || i > n) {
+#if USE_NUMA
+    i = (size_t)numa_current_node() % n + 1;
+#else /* USE_NUMA */
+    ACQUIRE_MALLOC_GLOBAL_LOCK();
+    i = arena_next++ % n + 1;
+    RELEASE_MALLOC_GLOBAL_LOCK();
+#endif /* USE_NUMA */
+    thread_arena = i;
+  }
+  return i - 1;
+}
+
+static mstate home_arena(void) {
+  mstate m;
+  ensure_initialization();
+  m = arena_at(arena_index());
+  return (m != 0)? m : gm;
+}
+
+/*
+  Allocate from the calling thread's arena. If its lock is busy, try
+  the others in turn, moving the thread to the first one that is
+  free, and otherwise wait for the thread's own arena.
+*/
+static void* arena_malloc(size_t bytes) {
+  size_t n = mparams.narenas;
+  size_t i = arena_index();
+  mstate m = arena_at(i);
+  void* mem;
+#if USE_PRESSURE_HANDLERS
+  size_t need;
+  int pressure;
+#endif /* USE_PRESSURE_HANDLERS */
+  if (m == 0)
+    m = gm;
+#if USE_NUMA
+  (void)n; /* stay on the thread's node */
+  (void)ACQUIRE_LOCK(&m->mutex);
+#else /* USE_NUMA */
+  if (!TRY_LOCK(&m->mutex)) {
+    mstate a = 0;
+    size_t j;
+    for (j = 1; j < n && a == 0; ++j) {
+      size_t k = (i + j) % n;
+      if ((a = arena_at(k)) != 0 && TRY_LOCK(&a->mutex))
+        thread_arena = k + 1;
+      else
+        a = 0;
+    }
+    if (a != 0)
+      m = a;
+    else
+      (void)ACQUIRE_LOCK(&m->mutex);
+  }
+#endif /* USE_NUMA */
+  mem = mspace_malloc_locked(m, bytes);
+#if USE_PRESSURE_HANDLERS
+  pressure = take_pressure(m, mem == 0, &need);
+  RELEASE_LOCK(&m->mutex);
+  if (pressure)
+    mem = relieve_pressure(m, mem, bytes, need);
+#else /* USE_PRESSURE_HANDLERS */
+  RELEASE_LOCK(&m->mutex);
+#endif /* USE_PRESSURE_HANDLERS */
+  return mem;
+}
+
+#endif /* USE_ARENAS */
+
 void mspace_free(mspace msp, void* mem) {
+#if USE_SLABS
+  if (is_slab_mem(mem)) {
+    free_slab_mem(mem);
+    return;
+  }
+#endif /* USE_SLABS */
   if (mem != 0) {
     mchunkptr p  = mem2chunk(mem);
 #if FOOTERS
@@ -5619,15 +9979,34 @@ void mspace_free(mspace msp, void* mem) {
       USAGE_ERROR_ACTION(fm, p);
       return;
     }
+#if USE_REMOTE_FREES
+    if (is_remote_free(fm)) {
+      push_remote_free(fm, p);
+      return;
+    }
+#endif /* USE_REMOTE_FREES */
     if (!PREACTION(fm)) {
       check_inuse_chunk(fm, p);
       if (RTCHECK(ok_address(fm, p) && ok_inuse(p))) {
         size_t psize = chunksize(p);
         mchunkptr next = chunk_plus_offset(p, psize);
+#if USE_FASTBINS
+        if (psize <= MAX_FAST_CHUNK && !is_mmapped(p)) {
+          insert_fast_chunk(fm, p, psize);
+          goto postaction;
+        }
+#endif /* USE_FASTBINS */
         if (!pinuse(p)) {
           size_t prevsize = p->prev_foot;
           if (is_mmapped(p)) {
+#if USE_ADAPTIVE_MMAP_THRESHOLD
+            adapt_mmap_threshold(psize);
+#endif /* USE_ADAPTIVE_MMAP_THRESHOLD */
             psize += prevsize + MMAP_FOOT_PAD;
+#if USE_MMAP_CACHE
+            if (mmap_cache_put(fm, (char*)p - prevsize, psize))
+              goto postaction;
+#endif /* USE_MMAP_CACHE */
             if (CALL_MUNMAP((char*)p - prevsize, psize) == 0)
               fm->footprint -= psize;
             goto postaction;
@@ -5693,8 +10072,15 @@ void mspace_free(mspace msp, void* mem) {
             tchunkptr tp = (tchunkptr)p;
             insert_large_chunk(fm, tp, psize);
             check_free_chunk(fm, p);
-            if (--fm->release_checks == 0)
+#if USE_INCREMENTAL_RELEASE
+            note_free_segment(fm, p, psize);
+#else /* USE_INCREMENTAL_RELEASE */
+            if (should_release(fm))
               release_unused_segments(fm);
+#endif /* USE_INCREMENTAL_RELEASE */
+#if USE_PAGE_PURGING
+            note_large_free(fm, psize);
+#endif /* USE_PAGE_PURGING */
           }
           goto postaction;
         }
@@ -5702,7 +10088,7 @@ void mspace_free(mspace msp, void* mem) {
     erroraction:
       USAGE_ERROR_ACTION(fm, p);
     postaction:
-      POSTACTION(fm);
+      FREE_POSTACTION(fm);
     }
   }
 }
@@ -5722,7 +10108,7 @@ void* mspace_calloc(mspace msp, size_t n_elements, size_t elem_size) {
       req = MAX_SIZE_T; /* force downstream failure on overflow */
   }
   mem = internal_malloc(ms, req);
-  if (mem != 0 && calloc_must_clear(mem2chunk(mem)))
+  if (mem != 0 && (is_slab_mem(mem) || calloc_must_clear(mem2chunk(mem))))
     memset(mem, 0, req);
   return mem;
 }
@@ -5740,6 +10126,11 @@ void* mspace_realloc(mspace msp, void* oldmem, size_t bytes) {
     mspace_free(msp, oldmem);
   }
 #endif /* REALLOC_ZERO_BYTES_FREES */
+#if USE_SLABS
+  else if (is_slab_mem(oldmem)) {
+    mem = slab_realloc(oldmem, bytes);
+  }
+#endif /* USE_SLABS */
   else {
     size_t nb = request2size(bytes);
     mchunkptr oldp = mem2chunk(oldmem);
@@ -5760,7 +10151,11 @@ void* mspace_realloc(mspace msp, void* oldmem, size_t bytes) {
         mem = chunk2mem(newp);
       }
       else {
-        mem = mspace_malloc(m, bytes);
+#if USE_REALLOC_MMAP
+        mem = realloc_mmap_alloc(m, nb);
+#endif /* USE_REALLOC_MMAP */
+        if (mem == 0)
+          mem = mspace_malloc(m, bytes);
         if (mem != 0) {
           size_t oc = chunksize(oldp) - overhead_for(oldp);
           memcpy(mem, oldmem, (oc < bytes)? oc : bytes);
@@ -5778,6 +10173,12 @@ void* mspace_realloc_in_place(mspace msp, void* oldmem, size_t bytes) {
     if (bytes >= MAX_REQUEST) {
       MALLOC_FAILURE_ACTION;
     }
+#if USE_SLABS
+    else if (is_slab_mem(oldmem)) {
+      if (bytes <= slab_of(oldmem)->size)
+        mem = oldmem;
+    }
+#endif /* USE_SLABS */
     else {
       size_t nb = request2size(bytes);
       mchunkptr oldp = mem2chunk(oldmem);
@@ -5811,7 +10212,7 @@ void* mspace_memalign(mspace msp, size_t alignment, size_t bytes) {
     return 0;
   }
   if (alignment <= MALLOC_ALIGNMENT)
-    return mspace_malloc(msp, bytes);
+    return mspace_malloc(msp, align_slab_request(bytes));
   return internal_memalign(ms, alignment, bytes);
 }
 
@@ -5840,6 +10241,16 @@ size_t mspace_bulk_free(mspace msp, void* array[], size_t nelem) {
   return internal_bulk_free((mstate)msp, array, nelem);
 }
 
+size_t mspace_bulk_free_sorted(mspace msp, void* array[], size_t nelem) {
+  mstate ms = (mstate)msp;
+  if (!ok_magic(ms)) {
+    USAGE_ERROR_ACTION(ms,ms);
+    return nelem;
+  }
+  sort_bulk_free_array(ms, array, nelem);
+  return internal_bulk_free(ms, array, nelem);
+}
+
 #if MALLOC_INSPECT_ALL
 void mspace_inspect_all(mspace msp,
                         void(*handler)(void *start,
@@ -5865,7 +10276,22 @@ int mspace_trim(mspace msp, size_t pad) {
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
     if (!PREACTION(ms)) {
+#if USE_REMOTE_FREES
+      if (ms->mflags & REMOTE_FREE_BIT)
+        release_remote_frees(ms);
+#endif /* USE_REMOTE_FREES */
+#if USE_FASTBINS
+      consolidate_fast_chunks(ms);
+#endif /* USE_FASTBINS */
       result = sys_trim(ms, pad);
+#if USE_MMAP_CACHE
+      if (mmap_cache_flush(ms) != 0)
+        result = 1;
+#endif /* USE_MMAP_CACHE */
+#if USE_PAGE_PURGING
+      if (purge_free_chunks(ms) != 0)
+        result = 1;
+#endif /* USE_PAGE_PURGING */
       POSTACTION(ms);
     }
   }
@@ -5911,6 +10337,20 @@ size_t mspace_max_footprint(mspace msp) {
   return result;
 }
 
+#if USE_RESIDENT_BYTES
+size_t mspace_resident_bytes(mspace msp) {
+  size_t result = 0;
+  mstate ms = (mstate)msp;
+  if (ok_magic(ms)) {
+    result = resident_bytes(ms);
+  }
+  else {
+    USAGE_ERROR_ACTION(ms,ms);
+  }
+  return result;
+}
+#endif /* USE_RESIDENT_BYTES */
+
 size_t mspace_footprint_limit(mspace msp) {
   size_t result = 0;
   mstate ms = (mstate)msp;
@@ -5927,7 +10367,7 @@ size_t mspace_footprint_limit(mspace msp) {
 size_t mspace_set_footprint_limit(mspace msp, size_t bytes) {
   size_t result = 0;
   mstate ms = (mstate)msp;
-  if (ok_magic(ms)) {
+  if (ok_magic(ms) && !(ms->mflags & NO_GROW_BIT)) {
     if (bytes == 0)
       result = granularity_align(1); /* Use minimal size */
     if (bytes == MAX_SIZE_T)
@@ -5942,6 +10382,21 @@ size_t mspace_set_footprint_limit(mspace msp, size_t bytes) {
   return result;
 }
 
+#if USE_PRESSURE_HANDLERS
+void mspace_set_pressure_handler(mspace msp,
+                                 int (*handler)(mspace, size_t, void*),
+                                 void* arg, size_t permille) {
+  mstate ms = (mstate)msp;
+  if (!ok_magic(ms) || (ms->mflags & SHARED_BIT)) {
+    USAGE_ERROR_ACTION(ms,ms);
+  }
+  else if (!PREACTION(ms)) {
+    set_pressure_handler(ms, handler, arg, permille);
+    POSTACTION(ms);
+  }
+}
+#endif /* USE_PRESSURE_HANDLERS */
+
 #if !NO_MALLINFO
 struct mallinfo mspace_mallinfo(mspace msp) {
   mstate ms = (mstate)msp;
@@ -5953,6 +10408,10 @@ struct mallinfo mspace_mallinfo(mspace msp) {
 #endif /* NO_MALLINFO */
 
 size_t mspace_usable_size(const void* mem) {
+#if USE_SLABS
+  if (is_slab_mem(mem))
+    return slab_of(mem)->size;
+#endif /* USE_SLABS */
   if (mem != 0) {
     mchunkptr p = mem2chunk(mem);
     if (is_inuse(p))
@@ -70,6 +70,12 @@ extern "C" {
 #define dlindependent_calloc   independent_calloc
 #define dlindependent_comalloc independent_comalloc
 #define dlbulk_free            bulk_free
+#define dlmalloc_batch         malloc_batch
+#define dlbulk_free_sorted     bulk_free_sorted
+#define dlmalloc_background_purge malloc_background_purge
+#define dlmalloc_node_footprint malloc_node_footprint
+#define dlmalloc_resident_bytes malloc_resident_bytes
+#define dlmalloc_set_pressure_handler malloc_set_pressure_handler
 #endif /* USE_DL_PREFIX */
 
 #if !NO_MALLINFO 
@@ -214,12 +220,22 @@ void* dlvalloc(size_t);
   M_TRIM_THRESHOLD     -1   2*1024*1024   any   (-1U disables trimming)
   M_GRANULARITY        -2     page size   any power of 2 >= page size
   M_MMAP_THRESHOLD     -3      256*1024   any   (or 0 if no MMAP support)
+  M_ARENAS             -4   #processors   1 to MAX_ARENAS (if USE_ARENAS)
+  M_PURGE_THRESHOLD    -5     1024*1024   any   (if USE_PAGE_PURGING)
+  M_PURGE_DECAY        -6            10   seconds > 0 (if USE_BACKGROUND_PURGE)
+  M_INLINE_TRIM        -7             1   0 or 1 (if USE_BACKGROUND_PURGE)
+  M_MMAP_THRESHOLD_MAX -8 4M*sizeof(size_t) any  (if USE_ADAPTIVE_MMAP_THRESHOLD)
 */
 int dlmallopt(int, int);
 
 #define M_TRIM_THRESHOLD     (-1)
 #define M_GRANULARITY        (-2)
 #define M_MMAP_THRESHOLD     (-3)
+#define M_ARENAS             (-4)
+#define M_PURGE_THRESHOLD    (-5)
+#define M_PURGE_DECAY        (-6)
+#define M_INLINE_TRIM        (-7)
+#define M_MMAP_THRESHOLD_MAX (-8)
 
 
 /*
@@ -246,6 +262,28 @@ size_t dlmalloc_footprint(void);
 */
 size_t dlmalloc_max_footprint(void);
 
+/*
+  malloc_node_footprint(int node);
+  Returns the number of bytes obtained from the system by the main
+  malloc space and arenas that are bound to the given NUMA node, which
+  is zero for all nodes unless USE_ARENAS is also set. Like
+  malloc_footprint, it does not use locks. Available only if compiled
+  with USE_NUMA.
+*/
+size_t dlmalloc_node_footprint(int node);
+
+/*
+  malloc_resident_bytes();
+  Returns the number of bytes of the memory obtained from the system
+  for the main malloc space (and arenas) that are resident, as found
+  by mincore. Unlike malloc_footprint, this excludes pages that were
+  purged or never touched, but it also excludes directly mmapped
+  chunks. It takes locks only briefly, a few segments at a time, so
+  the result is approximate while other threads allocate. Available
+  only if compiled with USE_RESIDENT_BYTES.
+*/
+size_t dlmalloc_resident_bytes(void);
+
 /*
   malloc_footprint_limit();
   Returns the number of bytes that the heap is allowed to obtain from
@@ -271,6 +309,21 @@ size_t dlmalloc_footprint_limit(void);
 */
 size_t dlmalloc_set_footprint_limit(size_t bytes);
 
+/*
+  malloc_set_pressure_handler(int (*handler)(void*, size_t, void*),
+                              void* arg, size_t permille);
+  Registers handler for the main malloc space and its arenas, as
+  mspace_set_pressure_handler does for an mspace, with marks and
+  shortfalls measured against the limit set by
+  malloc_set_footprint_limit. The first argument of handler is the
+  space under pressure (the main space or an arena). malloc is not
+  locked during the call, so the handler may free memory, but it
+  should not call malloc. Available only if compiled with
+  USE_PRESSURE_HANDLERS.
+*/
+void dlmalloc_set_pressure_handler(int (*handler)(void*, size_t, void*),
+                                   void* arg, size_t permille);
+
 /*
   malloc_inspect_all(void(*handler)(void *start,
                                     void *end,
@@ -438,6 +491,23 @@ void** dlindependent_calloc(size_t, size_t, void**);
 */
 void** dlindependent_comalloc(size_t, size_t*, void**);
 
+/*
+  malloc_batch(size_t n, size_t n_elements, void* chunks[]);
+
+  malloc_batch allocates n_elements chunks of at least n bytes each,
+  storing pointers to them in the chunks array, which must be of at
+  least n_elements in length. It returns the number of chunks
+  allocated, which is less than n_elements only if space ran out.
+  Unlike independent_calloc, the chunks are ordinary ones, allocated
+  just as if by separate calls to malloc (so large ones may be
+  separately mmapped), and nothing is cleared. But all of them are
+  obtained under a single lock acquisition, and small ones are carved
+  in a row from the same bin, dv or top chunk, which is usually much
+  faster than calling malloc n_elements times. They may be freed
+  individually, or all at once using bulk_free.
+*/
+size_t dlmalloc_batch(size_t, size_t, void**);
+
 /*
   bulk_free(void* array[], size_t n_elements)
   Frees and clears (sets to null) each non-null pointer in the given
@@ -445,10 +515,22 @@ void** dlindependent_comalloc(size_t, size_t*, void**);
   If footers are used, pointers that have been allocated in different
   mspaces are not freed or cleared, and the count of all such pointers
   is returned.  For large arrays of pointers with poor locality, it
-  may be worthwhile to sort this array before calling bulk_free.
+  may be worthwhile to sort this array before calling bulk_free, as
+  bulk_free_sorted does.
 */
 size_t  dlbulk_free(void**, size_t n_elements);
 
+/*
+  bulk_free_sorted(void* array[], size_t n_elements)
+  Like bulk_free, but first sorts the array by address, using scratch
+  space allocated from the heap, so that each run of chunks that are
+  adjacent in memory is coalesced into a single free chunk before
+  being binned. This is much faster than bulk_free for tearing down
+  large linked structures whose nodes were allocated together. The
+  order of any pointers left in the array is unspecified.
+*/
+size_t  dlbulk_free_sorted(void**, size_t n_elements);
+
 /*
   pvalloc(size_t n);
   Equivalent to valloc(minimum-page-that-holds(n)), that is,
@@ -475,10 +557,26 @@ void*  dlpvalloc(size_t);
   trailing space to service future expected allocations without having
   to re-obtain memory from the system.
 
+  If compiled with USE_PAGE_PURGING, malloc_trim also purges the pages
+  inside large free chunks, regardless of M_PURGE_THRESHOLD.
+  If compiled with USE_MMAP_CACHE, it also unmaps all cached regions.
+
   Malloc_trim returns 1 if it actually released any memory, else 0.
 */
 int  dlmalloc_trim(size_t);
 
+/*
+  malloc_background_purge(int enable);
+  Enables or disables returning the free memory of the main malloc
+  space (and of any arenas) to the system from a background thread,
+  which releases only memory that has stayed unused for the decay time
+  set by mallopt(M_PURGE_DECAY). The thread is started on first use.
+  Returns the previous setting; if the thread cannot be started, the
+  setting is left unchanged. Available only if compiled with
+  USE_BACKGROUND_PURGE.
+*/
+int dlmalloc_background_purge(int);
+
 /*
   malloc_stats();
   Prints on stderr the amount of space obtained from the system (both
@@ -497,6 +595,9 @@ int  dlmalloc_trim(size_t);
 
   malloc_stats prints only the most commonly interesting statistics.
   More information can be obtained by calling mallinfo.
+
+  If compiled with USE_ADAPTIVE_MMAP_THRESHOLD, malloc_stats also prints
+  the current mmap threshold and the number of times it was adjusted.
   
   malloc_stats is not compiled if NO_MALLOC_STATS is defined.
 */
@@ -541,6 +642,25 @@ typedef void* mspace;
 */
 mspace create_mspace(size_t capacity, int locked);
 
+/*
+  create_mspace_on_node behaves as create_mspace, except that all
+  memory obtained from the system for the space, including its initial
+  capacity, is bound to the given NUMA node. A negative node leaves
+  the memory unbound. Available only if compiled with USE_NUMA.
+*/
+mspace create_mspace_on_node(size_t capacity, int locked, int node);
+
+/*
+  create_mspace_reserved behaves as create_mspace, except that it
+  reserves reserve bytes of address space for the space up front, of
+  which only capacity bytes are initially committed. The space grows
+  by committing more of the reservation, and malloc_trim returns pages
+  at its top to the system while keeping them reserved. Once the
+  reservation is used up, the space grows as others do. Available only
+  if compiled with USE_RESERVED_MSPACES.
+*/
+mspace create_mspace_reserved(size_t reserve, size_t capacity, int locked);
+
 /*
   destroy_mspace destroys the given space, and attempts to return all
   of its memory back to the system, returning the total number of
@@ -560,6 +680,52 @@ size_t destroy_mspace(mspace msp);
 */
 mspace create_mspace_with_base(void* base, size_t capacity, int locked);
 
+/*
+  create_mspace_with_file creates (or truncates) the file at path,
+  sizes it to capacity rounded up to a page, and makes an mspace in a
+  shared mapping of it, or returns null on failure. The space can
+  never grow beyond the file. Chunks keep their addresses when the
+  file is reopened, so for example the first chunk allocated in the
+  space can hold pointers to the rest. Available only if compiled
+  with USE_FILE_MSPACES.
+*/
+mspace create_mspace_with_file(const char* path, size_t capacity, int locked);
+
+/*
+  open_mspace_file maps a file written by close_mspace_file at the
+  address it was created at, and returns its mspace, with all chunks
+  allocated in it still allocated. It returns null if the file cannot
+  be mapped there, was not closed cleanly, or was made by another
+  version or configuration of this malloc. Available only if compiled
+  with USE_FILE_MSPACES.
+*/
+mspace open_mspace_file(const char* path);
+
+/*
+  close_mspace_file writes back a space made by create_mspace_with_file
+  or open_mspace_file, marks its file as cleanly closed, and unmaps it,
+  returning 0 on success. Using the space afterwards is undefined, as
+  after destroy_mspace (which discards a file space without marking it
+  closed). Available only if compiled with USE_FILE_MSPACES.
+*/
+int close_mspace_file(mspace msp);
+
+/*
+  create_shared_mspace behaves as create_mspace_with_base with locking,
+  except that the space, placed in memory shared between processes
+  that map it at the same address, can be used by all of them. The
+  space never grows beyond capacity. Available only if compiled with
+  USE_SHARED_MSPACES.
+*/
+mspace create_shared_mspace(void* base, size_t capacity);
+
+/*
+  attach_shared_mspace returns the space that create_shared_mspace
+  made at base, typically in another process, or null if there is
+  none. Available only if compiled with USE_SHARED_MSPACES.
+*/
+mspace attach_shared_mspace(void* base);
+
 /*
   mspace_track_large_chunks controls whether requests for large chunks
   are allocated in their own untracked mmapped regions, separate from
@@ -573,6 +739,75 @@ mspace create_mspace_with_base(void* base, size_t capacity, int locked);
 */
 int mspace_track_large_chunks(mspace msp, int enable);
 
+/*
+  mspace_background_purge controls whether the free memory of this
+  space is returned to the system by the background purger, as for
+  malloc_background_purge. Only locked spaces can be purged in the
+  background; for others it does nothing and returns 0. The space is
+  removed from the purger when destroyed. The function returns the
+  previous setting. Available only if compiled with
+  USE_BACKGROUND_PURGE.
+*/
+int mspace_background_purge(mspace msp, int enable);
+
+#define MSPACE_PREFAULT      (1)
+#define MSPACE_MLOCK         (2)
+
+/*
+  mspace_prefault sets the prefaulting flags of this space, a
+  combination of MSPACE_PREFAULT, to populate memory as the space
+  obtains it (and its current top right away), and MSPACE_MLOCK, to
+  also lock its segments in memory; 0 turns both off, unlocking the
+  segments. Call it right after create_mspace to cover the whole
+  space. The function returns the previous flags. Available only if
+  compiled with USE_PREFAULT_MSPACES.
+*/
+int mspace_prefault(mspace msp, int flags);
+
+/*
+  mspace_locked_footprint returns the number of bytes of the segments
+  of this space that are locked in memory by MSPACE_MLOCK. Available
+  only if compiled with USE_PREFAULT_MSPACES.
+*/
+size_t mspace_locked_footprint(mspace msp);
+
+/*
+  mspace_set_pressure_handler registers handler, called with msp, a
+  shortfall and arg, to relieve memory pressure in a space with a
+  footprint limit (see mspace_set_footprint_limit). It is called with
+  a shortfall of 0 each time the footprint grows past a multiple of
+  permille thousandths of the limit (never, if permille is 0), and
+  with the number of bytes the request lacks when an allocation would
+  fail at the limit. The space is not locked during the call, so the
+  handler may free chunks of the space, but it should not allocate
+  from it. If the handler returns nonzero after a failure, the
+  allocation is retried once. A null handler removes it. Handlers are
+  not kept by files reopened with open_mspace_file, and cannot be set
+  for spaces made by create_shared_mspace. Available only if compiled
+  with USE_PRESSURE_HANDLERS.
+*/
+void mspace_set_pressure_handler(mspace msp,
+                                 int (*handler)(mspace, size_t, void*),
+                                 void* arg, size_t permille);
+
+/*
+  mspace_resident_bytes() returns the number of bytes of the segments
+  of this space that are resident, as malloc_resident_bytes does for
+  the main space. Available only if compiled with USE_RESIDENT_BYTES.
+*/
+size_t mspace_resident_bytes(mspace msp);
+
+/*
+  thread_mspace returns the calling thread's mspace, creating it (or
+  adopting an orphaned one) on first use, or 0 if none could be made.
+  The space is locked, so chunks allocated from it may be freed by
+  any thread. It must not be passed to destroy_mspace: when the thread
+  exits, it is destroyed if empty, and otherwise kept until the last
+  of its chunks is freed or another thread adopts it. Available only
+  if compiled with USE_THREAD_MSPACES.
+*/
+mspace thread_mspace(void);
+
 #if !NO_MALLINFO
 /*
   mspace_mallinfo behaves as mallinfo, but reports properties of
@@ -601,6 +836,9 @@ void** mspace_independent_calloc(mspace msp, size_t n_elements,
 void** mspace_independent_comalloc(mspace msp, size_t n_elements,
                                    size_t sizes[], void* chunks[]);
 size_t mspace_bulk_free(mspace msp, void**, size_t n_elements);
+size_t mspace_bulk_free_sorted(mspace msp, void**, size_t n_elements);
+size_t mspace_malloc_batch(mspace msp, size_t bytes, size_t n_elements,
+                           void** chunks);
 size_t mspace_usable_size(const void* mem);
 void mspace_malloc_stats(mspace msp);
 int mspace_trim(mspace msp, size_t pad);